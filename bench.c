@@ -0,0 +1,401 @@
+/* Copyright (C) 2019  C. McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "png.h"
+#include "torus.h"
+#include "render.h"
+
+static uint64_t now(void) {
+	struct timespec time;
+	int error = clock_gettime(CLOCK_MONOTONIC, &time);
+	if (error) err(EX_OSERR, "clock_gettime");
+	return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+static const struct Tile *tiles;
+
+static void tilesMap(const char *path) {
+	if (!path) {
+		tiles = mmap(
+			NULL, TilesSize, PROT_READ, MAP_PRIVATE | MAP_ANON, -1, 0
+		);
+		if (tiles == MAP_FAILED) err(EX_OSERR, "mmap");
+		return;
+	}
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) err(EX_NOINPUT, "%s", path);
+
+	struct stat stat;
+	int error = fstat(fd, &stat);
+	if (error) err(EX_IOERR, "%s", path);
+
+	if ((size_t)stat.st_size < TilesSize) {
+		errx(EX_DATAERR, "%s: truncated tiles", path);
+	}
+
+	tiles = mmap(NULL, TilesSize, PROT_READ, MAP_SHARED, fd, 0);
+	if (tiles == MAP_FAILED) err(EX_OSERR, "mmap");
+	close(fd);
+}
+
+static int streamWrite(void *cookie, const char *buf, int len) {
+	(void)cookie;
+	(void)buf;
+	return len;
+}
+
+static FILE *stream;
+static uint8_t *raster;
+static uint8_t *scanlines;
+static size_t rasterLen;
+static uint8_t *deflated;
+static size_t deflatedLen;
+static uint8_t *buffer;
+static size_t bufferLen;
+
+// Raster and deflated data are prepared once per tile for the benchmarks of
+// the later stages.
+static void prepare(const struct Tile *tile) {
+	rasterLen = renderHeight() * (1 + renderWidth());
+	bufferLen = compressBound(rasterLen);
+	if (!raster) {
+		raster = malloc(rasterLen);
+		scanlines = malloc(rasterLen);
+		deflated = malloc(bufferLen);
+		buffer = malloc(bufferLen);
+		if (!raster || !scanlines || !deflated || !buffer) {
+			err(EX_OSERR, "malloc");
+		}
+	}
+	renderRaster(raster, tile);
+	uLong len = bufferLen;
+	int error = compress(deflated, &len, raster, rasterLen);
+	if (error) errx(EX_SOFTWARE, "compress: %d", error);
+	deflatedLen = len;
+}
+
+static size_t benchRender(const struct Tile *tile) {
+	render(stream, tile);
+	fflush(stream);
+	return rasterLen;
+}
+
+static size_t benchRaster(const struct Tile *tile) {
+	renderRaster(raster, tile);
+	return rasterLen;
+}
+
+static size_t benchCompress(const struct Tile *tile) {
+	(void)tile;
+	uLong len = bufferLen;
+	int error = compress(buffer, &len, raster, rasterLen);
+	if (error) errx(EX_SOFTWARE, "compress: %d", error);
+	return rasterLen;
+}
+
+static size_t benchData(const struct Tile *tile) {
+	(void)tile;
+	pngData(stream, raster, rasterLen);
+	fflush(stream);
+	return rasterLen;
+}
+
+static size_t benchDeflated(const struct Tile *tile) {
+	(void)tile;
+	pngDeflated(stream, deflated, deflatedLen);
+	fflush(stream);
+	return deflatedLen;
+}
+
+static size_t encodedLen;
+
+// Packs, filters and deflates the prepared raster with the current options.
+static size_t benchEncode(const struct Tile *tile) {
+	(void)tile;
+	memcpy(scanlines, raster, rasterLen);
+	size_t len = renderScanlines(scanlines);
+	encodedLen = renderDeflate(buffer, bufferLen, scanlines, len);
+	return rasterLen;
+}
+
+// The server answers maps from a pyramid of tile metadata built at startup,
+// each level summing two by two blocks of the one below. It is built here the
+// same way.
+enum { MetaLevels = 10 };
+static struct Meta *metaLevels[MetaLevels];
+
+static struct Meta *metaCell(int level, uint32_t tileX, uint32_t tileY) {
+	uint32_t cols = TileCols >> level;
+	return &metaLevels[level][(tileY >> level) * cols + (tileX >> level)];
+}
+
+static uint32_t saturate(uint32_t a, uint32_t b) {
+	return (a + b < a ? UINT32_MAX : a + b);
+}
+
+static void metaMerge(struct Meta *meta, struct Meta add) {
+	if (add.createTime) {
+		if (!meta->createTime || add.createTime < meta->createTime) {
+			meta->createTime = add.createTime;
+		}
+	}
+	if (add.modifyTime > meta->modifyTime) meta->modifyTime = add.modifyTime;
+	if (add.accessTime > meta->accessTime) meta->accessTime = add.accessTime;
+	meta->modifyCount = saturate(meta->modifyCount, add.modifyCount);
+	meta->accessCount = saturate(meta->accessCount, add.accessCount);
+}
+
+static void metaBuild(void) {
+	for (int level = 0; level < MetaLevels; ++level) {
+		size_t len = (size_t)(TileRows >> level) * (TileCols >> level);
+		metaLevels[level] = calloc(len, sizeof(struct Meta));
+		if (!metaLevels[level]) err(EX_OSERR, "calloc");
+	}
+	for (uint32_t tileY = 0; tileY < TileRows; ++tileY) {
+		for (uint32_t tileX = 0; tileX < TileCols; ++tileX) {
+			struct Meta meta = tileMeta(&tiles[tileY * TileRows + tileX]);
+			for (int level = 0; level < MetaLevels; ++level) {
+				metaMerge(metaCell(level, tileX, tileY), meta);
+			}
+		}
+	}
+}
+
+static uint8_t mapZoom;
+
+static size_t benchMap(const struct Tile *tile) {
+	(void)tile;
+	int32_t rows = TileRows >> mapZoom;
+	int32_t cols = TileCols >> mapZoom;
+	int32_t mapY = (int32_t)(TileInitY >> mapZoom) - MapRows / 2;
+	int32_t mapX = (int32_t)(TileInitX >> mapZoom) - MapCols / 2;
+
+	struct Map map;
+	mapInit(&map, time(NULL));
+	for (int32_t y = 0; y < MapRows; ++y) {
+		for (int32_t x = 0; x < MapCols; ++x) {
+			uint32_t blockY = ((mapY + y) % rows + rows) % rows;
+			uint32_t blockX = ((mapX + x) % cols + cols) % cols;
+			struct Meta *meta = metaCell(
+				mapZoom, blockX << mapZoom, blockY << mapZoom
+			);
+			mapSet(&map, y, x, *meta);
+		}
+	}
+	fwrite(&map, sizeof(map), 1, stream);
+	fflush(stream);
+	return sizeof(map);
+}
+
+// Aggregating the window from tile headers, as the server did before it kept
+// the pyramid, is timed as a baseline.
+static size_t benchMapTiles(const struct Tile *tile) {
+	(void)tile;
+	int32_t mapY = (int32_t)TileInitY - MapRows / 2;
+	int32_t mapX = (int32_t)TileInitX - MapCols / 2;
+
+	struct Map map;
+	mapInit(&map, time(NULL));
+	for (int32_t y = 0; y < MapRows; ++y) {
+		for (int32_t x = 0; x < MapCols; ++x) {
+			uint32_t tileY = ((mapY + y) % TileRows + TileRows) % TileRows;
+			uint32_t tileX = ((mapX + x) % TileCols + TileCols) % TileCols;
+			mapSet(&map, y, x, tileMeta(&tiles[tileY * TileRows + tileX]));
+		}
+	}
+	fwrite(&map, sizeof(map), 1, stream);
+	fflush(stream);
+	return sizeof(map);
+}
+
+static const struct {
+	const char *name;
+	size_t (*fn)(const struct Tile *);
+} Benches[] = {
+	{ "render", benchRender },
+	{ "raster", benchRaster },
+	{ "compress", benchCompress },
+	{ "pngData", benchData },
+	{ "pngDeflated", benchDeflated },
+};
+
+static size_t warmup = 10;
+static size_t reps = 100;
+static FILE *results;
+
+static void bench(
+	const char *name, const char *tileName, const struct Tile *tile,
+	size_t (*fn)(const struct Tile *)
+) {
+	for (size_t i = 0; i < warmup; ++i) fn(tile);
+
+	size_t bytes = 0;
+	uint64_t total = 0;
+	uint64_t min = UINT64_MAX;
+	for (size_t i = 0; i < reps; ++i) {
+		uint64_t start = now();
+		bytes = fn(tile);
+		uint64_t elapsed = now() - start;
+		total += elapsed;
+		if (elapsed < min) min = elapsed;
+	}
+
+	double ns = (double)total / reps;
+	double mbs = bytes / ns * 1e3;
+	printf(
+		"%-24s %-8s %12.0f ns/op %12ju ns/min %10.1f MB/s",
+		name, tileName, ns, (uintmax_t)min, mbs
+	);
+	if (encodedLen) printf(" %8zu B", encodedLen);
+	printf("\n");
+	if (results) {
+		fprintf(
+			results, "%s\t%s\t%zu\t%.0f\t%ju\t%.1f\t%zu\n",
+			name, tileName, reps, ns, (uintmax_t)min, mbs, encodedLen
+		);
+	}
+	encodedLen = 0;
+}
+
+// Each depth and filter is tried with each strategy at the default level, and
+// with the default strategy at the fastest and best levels.
+static void benchEncodings(const char *tileName, const struct Tile *tile) {
+	static const struct {
+		int level;
+		size_t strategy;
+	} Configs[] = {
+		{ Z_DEFAULT_COMPRESSION, 0 }, { Z_DEFAULT_COMPRESSION, 1 },
+		{ Z_DEFAULT_COMPRESSION, 2 }, { Z_DEFAULT_COMPRESSION, 3 },
+		{ Z_DEFAULT_COMPRESSION, 4 }, { 1, 0 }, { 9, 0 },
+	};
+	static const uint8_t Depths[] = { 8, 4 };
+	struct RenderOptions options = renderOptions;
+	for (size_t d = 0; d < ARRAY_LEN(Depths); ++d) {
+		for (uint8_t f = 0; f < ARRAY_LEN(RenderFilterNames); ++f) {
+			for (size_t c = 0; c < ARRAY_LEN(Configs); ++c) {
+				renderOptions.depth = Depths[d];
+				renderOptions.filter = f;
+				renderOptions.level = Configs[c].level;
+				renderOptions.strategy =
+					RenderStrategies[Configs[c].strategy].strategy;
+				char name[64];
+				snprintf(
+					name, sizeof(name), "%u/%s/%s/%d",
+					Depths[d], RenderFilterNames[f],
+					RenderStrategies[Configs[c].strategy].name,
+					Configs[c].level
+				);
+				bench(name, tileName, tile, benchEncode);
+			}
+		}
+	}
+	renderOptions = options;
+}
+
+int main(int argc, char *argv[]) {
+	const char *dataPath = NULL;
+	const char *fontPath = DefaultFontPath;
+	const char *resultsPath = NULL;
+	bool encodings = false;
+
+	int opt;
+	while (0 < (opt = getopt(argc, argv, "d:ef:n:o:w:"))) {
+		switch (opt) {
+			break; case 'd': dataPath = optarg;
+			break; case 'e': encodings = true;
+			break; case 'f': fontPath = optarg;
+			break; case 'n': reps = strtoul(optarg, NULL, 0);
+			break; case 'o': resultsPath = optarg;
+			break; case 'w': warmup = strtoul(optarg, NULL, 0);
+			break; default:  return EX_USAGE;
+		}
+	}
+	if (!reps) return EX_USAGE;
+
+	fontLoad(fontPath);
+	tilesMap(dataPath);
+
+	stream = fwopen(NULL, streamWrite);
+	if (!stream) err(EX_OSERR, "fwopen");
+
+	if (resultsPath) {
+		results = fopen(resultsPath, "w");
+		if (!results) err(EX_CANTCREAT, "%s", resultsPath);
+		fprintf(
+			results, "bench\ttile\treps\tns/op\tns/min\tMB/s\tbytes\n"
+		);
+	}
+
+	// Synthetic tiles are generated from a fixed seed so that results are
+	// comparable across runs.
+	static struct Tile blankTile, denseTile, randomTile;
+	memset(blankTile.cells, ' ', CellsSize);
+	memset(blankTile.colors, ColorWhite, CellsSize);
+	srand(1);
+	for (uint8_t y = 0; y < CellRows; ++y) {
+		for (uint8_t x = 0; x < CellCols; ++x) {
+			denseTile.cells[y][x] = '!' + (y * CellCols + x) % ('~' - '!');
+			denseTile.colors[y][x] = ColorWhite;
+			randomTile.cells[y][x] = rand();
+			randomTile.colors[y][x] = rand();
+		}
+	}
+
+	struct {
+		const char *name;
+		const struct Tile *tile;
+	} Tiles[] = {
+		{ "blank", &blankTile },
+		{ "dense", &denseTile },
+		{ "random", &randomTile },
+		{ "data", &tiles[TileInitY * TileRows + TileInitX] },
+	};
+	size_t tilesLen = ARRAY_LEN(Tiles) - (dataPath ? 0 : 1);
+
+	for (size_t t = 0; t < tilesLen; ++t) {
+		prepare(Tiles[t].tile);
+		for (size_t b = 0; b < ARRAY_LEN(Benches); ++b) {
+			bench(Benches[b].name, Tiles[t].name, Tiles[t].tile, Benches[b].fn);
+		}
+		if (encodings) benchEncodings(Tiles[t].name, Tiles[t].tile);
+	}
+	const char *mapTile = (dataPath ? "data" : "blank");
+	bench("map/tiles", mapTile, NULL, benchMapTiles);
+	metaBuild();
+	bench("map", mapTile, NULL, benchMap);
+	mapZoom = MapZoomMax;
+	bench("map/zoom", mapTile, NULL, benchMap);
+
+	if (results) {
+		int error = fclose(results);
+		if (error) err(EX_IOERR, "%s", resultsPath);
+	}
+}
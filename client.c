@@ -173,6 +173,12 @@ static const uint8_t MapColors[] = {
 	ColorBlue, ColorCyan, ColorGreen, ColorYellow, ColorRed,
 };
 
+static struct {
+	uint8_t zoom;
+	int8_t dx;
+	int8_t dy;
+} mapView;
+
 static void serverMap(void) {
 	int t = MapY - 1;
 	int l = MapX - 1;
@@ -220,7 +226,11 @@ static void serverMap(void) {
 			wchar_t cell = MapCells[count];
 			uint8_t color = MapColors[time];
 			wchar_t tile[] = { cell, cell, cell, L'\0' };
-			if (y == MapRows / 2 && x == MapCols / 2) tile[1] = L'⌂';
+			if (
+				y == MapRows / 2 - mapView.dy && x == MapCols / 2 - mapView.dx
+			) {
+				tile[1] = L'⌂';
+			}
 			attr_set(colorAttr(color), colorPair(color), NULL);
 			mvaddwstr(MapY + y, MapX + 3 * x, tile);
 		}
@@ -228,6 +238,56 @@ static void serverMap(void) {
 	attr_set(A_NORMAL, 0, NULL);
 }
 
+static const uint8_t MinimapX = (CellCols - MinimapCols * ThumbCols) / 2;
+static const uint8_t MinimapY = (CellRows - MinimapRows * ThumbRows / 2) / 2;
+
+// Each character shows two blocks, the upper in the foreground color and the
+// lower in the background color.
+static void serverThumb(void) {
+	struct Minimap minimap;
+	ssize_t size = recv(client, &minimap, sizeof(minimap), 0);
+	if (size < 0) err(EX_IOERR, "recv");
+	if ((size_t)size < sizeof(minimap)) errx(EX_PROTOCOL, "truncated thumb");
+
+	enum {
+		Rows = MinimapRows * ThumbRows,
+		Cols = MinimapCols * ThumbCols,
+	};
+	uint8_t blocks[Rows + 1][Cols];
+	memset(blocks, 0, sizeof(blocks));
+	for (int y = 0; y < Rows; ++y) {
+		for (int x = 0; x < Cols; ++x) {
+			const struct Thumb *thumb =
+				&minimap.thumbs[y / ThumbRows][x / ThumbCols];
+			blocks[y][x] = thumb->colors[y % ThumbRows][x % ThumbCols];
+		}
+	}
+
+	int t = MinimapY - 1;
+	int l = MinimapX - 1;
+	int b = MinimapY + (Rows + 1) / 2;
+	int r = MinimapX + Cols;
+	color_set(colorPair(ColorWhite), NULL);
+	mvhline(t, MinimapX, ACS_HLINE, Cols);
+	mvhline(b, MinimapX, ACS_HLINE, Cols);
+	mvvline(MinimapY, l, ACS_VLINE, (Rows + 1) / 2);
+	mvvline(MinimapY, r, ACS_VLINE, (Rows + 1) / 2);
+	mvaddch(t, l, ACS_ULCORNER);
+	mvaddch(t, r, ACS_URCORNER);
+	mvaddch(b, l, ACS_LLCORNER);
+	mvaddch(b, r, ACS_LRCORNER);
+
+	for (int y = 0; y < Rows; y += 2) {
+		for (int x = 0; x < Cols; ++x) {
+			uint8_t color = blocks[y][x] | (blocks[y + 1][x] & 007) << 4;
+			cchar_t cch;
+			setcchar(&cch, L"▀", colorAttr(color), colorPair(color), NULL);
+			mvadd_wch(MinimapY + y / 2, MinimapX + x, &cch);
+		}
+	}
+	attr_set(A_NORMAL, 0, NULL);
+}
+
 static void readMessage(void) {
 	struct ServerMessage msg;
 	ssize_t size = recv(client, &msg, sizeof(msg), 0);
@@ -240,6 +300,7 @@ static void readMessage(void) {
 		break; case ServerPut:    serverPut(msg);
 		break; case ServerCursor: serverCursor(msg);
 		break; case ServerMap:    serverMap();
+		break; case ServerThumb:  serverThumb();
 		break; default: errx(EX_PROTOCOL, "unknown message type %d", msg.type);
 	}
 	move(cellY, cellX);
@@ -267,7 +328,15 @@ static void clientPut(uint8_t color, uint8_t cell) {
 }
 
 static void clientMap(void) {
-	struct ClientMessage msg = { .type = ClientMap };
+	struct ClientMessage msg = {
+		.type = ClientMap,
+		.map = { .zoom = mapView.zoom, .dx = mapView.dx, .dy = mapView.dy },
+	};
+	clientMessage(msg);
+}
+
+static void clientThumb(void) {
+	struct ClientMessage msg = { .type = ClientThumb };
 	clientMessage(msg);
 }
 
@@ -281,6 +350,7 @@ static struct {
 		ModeNormal,
 		ModeHelp,
 		ModeMap,
+		ModeMinimap,
 		ModeDirection,
 		ModeInsert,
 		ModeReplace,
@@ -319,9 +389,17 @@ static void modeHelp(void) {
 }
 static void modeMap(void) {
 	curs_set(0);
+	mapView.zoom = 0;
+	mapView.dx = 0;
+	mapView.dy = 0;
 	clientMap();
 	input.mode = ModeMap;
 }
+static void modeMinimap(void) {
+	curs_set(0);
+	clientThumb();
+	input.mode = ModeMinimap;
+}
 static void modeDirection(void) {
 	input.mode = ModeDirection;
 }
@@ -484,6 +562,7 @@ static void inputNormal(bool keyCode, wchar_t ch) {
 
 		break; case '?': modeHelp();
 		break; case 'm': modeMap();
+		break; case 'M': modeMinimap();
 		break; case 'I': modeDirection();
 		break; case 'i': modeInsert(1, 0);
 		break; case 'a': modeInsert(1, 0); clientMove(1, 0);
@@ -500,7 +579,53 @@ static void inputHelp(bool keyCode, wchar_t ch) {
 	modeNormal();
 }
 
+static int8_t mapPan(int8_t d, int step) {
+	int pan = d + step;
+	if (pan > INT8_MAX) pan = INT8_MAX;
+	if (pan < INT8_MIN) pan = INT8_MIN;
+	return pan;
+}
+
+// Zooming keeps the center of the map in place.
+static void mapZoom(int zoom) {
+	if (zoom < 0 || zoom > MapZoomMax) return;
+	if (zoom > mapView.zoom) {
+		mapView.dx = mapView.dx / 2;
+		mapView.dy = mapView.dy / 2;
+	} else {
+		mapView.dx = mapPan(0, 2 * mapView.dx);
+		mapView.dy = mapPan(0, 2 * mapView.dy);
+	}
+	mapView.zoom = zoom;
+}
+
 static void inputMap(bool keyCode, wchar_t ch) {
+	if (keyCode) {
+		switch (ch) {
+			break; case KEY_LEFT:  ch = 'h';
+			break; case KEY_RIGHT: ch = 'l';
+			break; case KEY_UP:    ch = 'k';
+			break; case KEY_DOWN:  ch = 'j';
+		}
+	}
+	switch (ch) {
+		break; case 'h': mapView.dx = mapPan(mapView.dx, -1);
+		break; case 'l': mapView.dx = mapPan(mapView.dx, 1);
+		break; case 'k': mapView.dy = mapPan(mapView.dy, -1);
+		break; case 'j': mapView.dy = mapPan(mapView.dy, 1);
+		break; case '-': mapZoom(mapView.zoom + 1);
+		break; case '+': case '=': mapZoom(mapView.zoom - 1);
+		break; case '0': mapView.dx = 0; mapView.dy = 0;
+		break; default: {
+			drawTile(&tile);
+			modeNormal();
+			return;
+		}
+	}
+	clientMap();
+}
+
+static void inputMinimap(bool keyCode, wchar_t ch) {
 	(void)keyCode;
 	(void)ch;
 	drawTile(&tile);
@@ -672,6 +797,7 @@ static void readInput(void) {
 		break; case ModeNormal:    inputNormal(keyCode, ch);
 		break; case ModeHelp:      inputHelp(keyCode, ch);
 		break; case ModeMap:       inputMap(keyCode, ch);
+		break; case ModeMinimap:   inputMinimap(keyCode, ch);
 		break; case ModeDirection: inputDirection(keyCode, ch);
 		break; case ModeInsert:    inputInsert(keyCode, ch);
 		break; case ModeReplace:   inputReplace(keyCode, ch);
@@ -16,6 +16,7 @@
 
 #include <err.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -23,7 +24,9 @@
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <sysexits.h>
+#include <time.h>
 #include <unistd.h>
 #include <zlib.h>
 
@@ -44,61 +47,7 @@
 
 #include "png.h"
 #include "torus.h"
-
-static const uint8_t Palette[16][3] = {
-	{ 0x00, 0x00, 0x00 },
-	{ 0xAA, 0x00, 0x00 },
-	{ 0x00, 0xAA, 0x00 },
-	{ 0xAA, 0x55, 0x00 },
-	{ 0x00, 0x00, 0xAA },
-	{ 0xAA, 0x00, 0xAA },
-	{ 0x00, 0xAA, 0xAA },
-	{ 0xAA, 0xAA, 0xAA },
-	{ 0x55, 0x55, 0x55 },
-	{ 0xFF, 0x55, 0x55 },
-	{ 0x55, 0xFF, 0x55 },
-	{ 0xFF, 0xFF, 0x55 },
-	{ 0x55, 0x55, 0xFF },
-	{ 0xFF, 0x55, 0xFF },
-	{ 0x55, 0xFF, 0xFF },
-	{ 0xFF, 0xFF, 0xFF },
-};
-
-static struct {
-	uint32_t magic;
-	uint32_t version;
-	uint32_t size;
-	uint32_t flags;
-	struct {
-		uint32_t len;
-		uint32_t size;
-		uint32_t height;
-		uint32_t width;
-	} glyph;
-} font;
-
-static uint8_t *glyphs;
-
-static void fontLoad(const char *path) {
-	FILE *file = fopen(path, "r");
-	if (!file) err(EX_NOINPUT, "%s", path);
-
-	size_t len = fread(&font, sizeof(font), 1, file);
-	if (ferror(file)) err(EX_IOERR, "%s", path);
-	if (len < 1) errx(EX_DATAERR, "%s: truncated header", path);
-
-	if (font.magic != 0x864AB572 || font.size != sizeof(font)) {
-		errx(EX_DATAERR, "%s: invalid header", path);
-	}
-
-	glyphs = calloc(font.glyph.len, font.glyph.size);
-	if (!glyphs) err(EX_OSERR, "calloc");
-
-	len = fread(glyphs, font.glyph.size, font.glyph.len, file);
-	if (ferror(file)) err(EX_IOERR, "%s", path);
-	if (len < font.glyph.len) errx(EX_DATAERR, "%s: truncated glyphs", path);
-	fclose(file);
-}
+#include "render.h"
 
 static struct Tile (*tiles)[TileRows][TileCols];
 
@@ -127,46 +76,8 @@ static void tilesMap(const char *path) {
 #endif
 }
 
-static void render(FILE *stream, uint32_t tileX, uint32_t tileY) {
-	uint32_t width = CellCols * font.glyph.width;
-	uint32_t height = CellRows * font.glyph.height;
-
-	pngHead(stream, width, height, 8, PNGIndexed);
-	pngPalette(stream, (uint8_t *)Palette, sizeof(Palette));
-
-	uint8_t data[height][1 + width];
-	memset(data, PNGNone, sizeof(data));
-
-	uint32_t widthBytes = (font.glyph.width + 7) / 8;
-	uint8_t (*bits)[font.glyph.len][font.glyph.height][widthBytes];
-	bits = (void *)glyphs;
-
-	struct Tile *tile = &(*tiles)[tileY][tileX];
-	for (uint32_t cellY = 0; cellY < CellRows; ++cellY) {
-		for (uint32_t cellX = 0; cellX < CellCols; ++cellX) {
-			uint8_t cell = tile->cells[cellY][cellX];
-			uint8_t fg = tile->colors[cellY][cellX] & 0x0F;
-			uint8_t bg = tile->colors[cellY][cellX] >> 4;
-
-			uint32_t glyphX = font.glyph.width * cellX;
-			uint32_t glyphY = font.glyph.height * cellY;
-			for (uint32_t y = 0; y < font.glyph.height; ++y) {
-				for (uint32_t x = 0; x < font.glyph.width; ++x) {
-					uint8_t bit = (*bits)[cell][y][x / 8] >> (7 - x % 8) & 1;
-					data[glyphY + y][1 + glyphX + x] = (bit ? fg : bg);
-				}
-			}
-		}
-	}
-
-	uLong zlen = compressBound(sizeof(data));
-	uint8_t zdata[zlen];
-	int error = compress(zdata, &zlen, (uint8_t *)data, sizeof(data));
-	if (error) errx(EX_SOFTWARE, "compress: %d", error);
-
-	pngDeflated(stream, zdata, (size_t)zlen);
-	pngTail(stream);
-}
+static size_t cacheCap = 16 * 1024 * 1024;
+static size_t workersLen = 1;
 
 #ifdef HAVE_KCGI
 
@@ -176,80 +87,605 @@ static const struct kvalid Keys[KeysLen] = {
 	[KeyY] = { .name = "y", .valid = kvalid_int },
 };
 
-enum { PageTile, PagesLen };
+enum { PageTile, PageStats, PageCells, PageFont, PagesLen };
 static const char *Pages[PagesLen] = {
 	[PageTile] = "tile",
+	[PageStats] = "stats",
+	[PageCells] = "cells",
+	[PageFont] = "font",
 };
 
 static noreturn void errkcgi(int eval, enum kcgi_err code, const char *str) {
 	errx(eval, "%s: %s", str, kcgi_strerror(code));
 }
 
-struct Stream {
-	struct kreq *req;
-	bool hup;
+static uint64_t now(void) {
+	struct timespec time;
+	int error = clock_gettime(CLOCK_MONOTONIC, &time);
+	if (error) err(EX_OSERR, "clock_gettime");
+	return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+// Workers share the tiles and font mapped before forking, and count their
+// requests and cache use in shared memory so that any of them can serve the
+// stats page. Only the pool writes pid and restart.
+struct Worker {
+	pid_t pid;
+	bool restart;
+	uint64_t restarts;
+	uint64_t requests;
+	uint64_t notModified;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t hitNanos;
+	uint64_t missNanos;
+	uint64_t entries;
+	uint64_t bytes;
+};
+
+static struct Worker *workers;
+static struct Worker *self;
+
+// Rendered PNGs are cached with the metadata of the tile when it was read,
+// and are rendered again once the tile has been modified. The least recently
+// used are evicted to keep the total size within the cap.
+struct Entry {
+	uint32_t tileX;
+	uint32_t tileY;
+	time_t createTime;
+	time_t modifyTime;
+	uint32_t modifyCount;
+	char *png;
+	size_t len;
+	struct Entry *prev;
+	struct Entry *next;
 };
 
-// XXX: Swallow writes after the connection is closed.
-static int streamWrite(void *cookie, const char *buf, int len) {
-	struct Stream *stream = cookie;
-	if (stream->hup) return len;
-	enum kcgi_err error = khttp_write(stream->req, buf, (size_t)len);
-	if (error) {
-		if (error != KCGI_HUP) errkcgi(EX_IOERR, error, "khttp_write");
-		stream->hup = true;
+static struct {
+	struct Entry *head;
+	struct Entry *tail;
+	struct Entry *(*index)[TileCols];
+} cache;
+
+static void cacheUnlink(struct Entry *entry) {
+	if (entry->prev) entry->prev->next = entry->next;
+	if (entry->next) entry->next->prev = entry->prev;
+	if (cache.head == entry) cache.head = entry->next;
+	if (cache.tail == entry) cache.tail = entry->prev;
+	entry->prev = NULL;
+	entry->next = NULL;
+}
+
+static void cachePush(struct Entry *entry) {
+	entry->next = cache.head;
+	if (cache.head) cache.head->prev = entry;
+	cache.head = entry;
+	if (!cache.tail) cache.tail = entry;
+}
+
+static void cacheRemove(struct Entry *entry) {
+	cacheUnlink(entry);
+	cache.index[entry->tileY][entry->tileX] = NULL;
+	self->bytes -= entry->len;
+	self->entries--;
+	free(entry->png);
+	free(entry);
+}
+
+static struct Entry *cacheGet(uint32_t tileX, uint32_t tileY) {
+	if (!cache.index) {
+		cache.index = calloc(TileRows, sizeof(*cache.index));
+		if (!cache.index) err(EX_OSERR, "calloc");
+	}
+
+	const struct Tile *tile = &(*tiles)[tileY][tileX];
+	struct Entry *entry = cache.index[tileY][tileX];
+	if (
+		entry &&
+		entry->createTime == tile->createTime &&
+		entry->modifyTime == tile->modifyTime &&
+		entry->modifyCount == tile->modifyCount
+	) {
+		self->hits++;
+		cacheUnlink(entry);
+		cachePush(entry);
+		return entry;
+	}
+	self->misses++;
+	if (entry) cacheRemove(entry);
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry) err(EX_OSERR, "calloc");
+	entry->tileX = tileX;
+	entry->tileY = tileY;
+	entry->createTime = tile->createTime;
+	entry->modifyTime = tile->modifyTime;
+	entry->modifyCount = tile->modifyCount;
+
+	FILE *stream = open_memstream(&entry->png, &entry->len);
+	if (!stream) err(EX_OSERR, "open_memstream");
+	render(stream, tile);
+	int error = fclose(stream);
+	if (error) err(EX_OSERR, "open_memstream");
+
+	cachePush(entry);
+	cache.index[tileY][tileX] = entry;
+	self->bytes += entry->len;
+	self->entries++;
+	while (self->bytes > cacheCap && cache.tail != entry) {
+		cacheRemove(cache.tail);
+		self->evictions++;
+	}
+	return entry;
+}
+
+// Tiles are tagged by their coordinates and modification count, and dated
+// by their last modification, so that browsers revalidate rather than
+// fetch tiles again.
+static void tileTag(
+	char *buf, size_t cap, uint32_t tileX, uint32_t tileY,
+	time_t createTime, uint32_t modifyCount
+) {
+	snprintf(
+		buf, cap, "\"%x-%x-%jx-%x\"",
+		tileX, tileY, (uintmax_t)createTime, modifyCount
+	);
+}
+
+static time_t tileDate(time_t createTime, time_t modifyTime) {
+	return (modifyTime ? modifyTime : createTime);
+}
+
+// If-None-Match takes precedence over If-Modified-Since.
+static bool tileFresh(const struct kreq *req, const char *tag, time_t date) {
+	const struct khead *match = req->reqmap[KREQU_IF_NONE_MATCH];
+	if (match) return !strcmp(match->val, "*") || strstr(match->val, tag);
+
+	const struct khead *since = req->reqmap[KREQU_IF_MODIFIED_SINCE];
+	if (!since) return false;
+	struct tm tm = {0};
+	const char *end = strptime(since->val, "%a, %d %b %Y %T GMT", &tm);
+	if (!end || *end) return false;
+	return date <= timegm(&tm);
+}
+
+static enum kcgi_err tileHead(
+	struct kreq *req, enum khttp status, const char *tag, time_t date
+) {
+	enum kcgi_err error = khttp_head(
+		req, kresps[KRESP_STATUS], "%s", khttps[status]
+	);
+	if (error) return error;
+
+	char buf[64];
+	kutil_epoch2str(date, buf, sizeof(buf));
+	error = khttp_head(req, kresps[KRESP_ETAG], "%s", tag);
+	if (error) return error;
+	error = khttp_head(req, kresps[KRESP_LAST_MODIFIED], "%s", buf);
+	if (error) return error;
+	return khttp_head(req, kresps[KRESP_CACHE_CONTROL], "%s", "no-cache");
+}
+
+static void tileCoords(
+	const struct kreq *req, uint32_t *tileX, uint32_t *tileY
+) {
+	*tileX = TileInitX;
+	*tileY = TileInitY;
+	if (req->fieldmap[KeyX]) {
+		*tileX = (uint32_t)req->fieldmap[KeyX]->parsed.i % TileCols;
+	}
+	if (req->fieldmap[KeyY]) {
+		*tileY = (uint32_t)req->fieldmap[KeyY]->parsed.i % TileRows;
+	}
+}
+
+// Answers with 304 if the request's validators match the tile.
+static bool tileNotModified(struct kreq *req, uint32_t tileX, uint32_t tileY) {
+	char tag[64];
+	const struct Tile *tile = &(*tiles)[tileY][tileX];
+	tileTag(
+		tag, sizeof(tag), tileX, tileY, tile->createTime, tile->modifyCount
+	);
+	time_t date = tileDate(tile->createTime, tile->modifyTime);
+	if (!tileFresh(req, tag, date)) return false;
+
+	self->notModified++;
+	enum kcgi_err error = tileHead(req, KHTTP_304, tag, date);
+	if (error == KCGI_HUP) return true;
+	if (error) errkcgi(EX_IOERR, error, "khttp_head");
+	error = khttp_body(req);
+	if (error == KCGI_HUP) return true;
+	if (error) errkcgi(EX_IOERR, error, "khttp_body");
+	return true;
+}
+
+static void pageTile(struct kreq *req) {
+	uint32_t tileX, tileY;
+	tileCoords(req, &tileX, &tileY);
+	if (tileNotModified(req, tileX, tileY)) return;
+
+	uint64_t start = now();
+	uint64_t misses = self->misses;
+	const struct Entry *entry = cacheGet(tileX, tileY);
+	if (self->misses > misses) {
+		self->missNanos += now() - start;
+	} else {
+		self->hitNanos += now() - start;
+	}
+
+	// The entry may be newer than the tile as checked above.
+	char tag[64];
+	tileTag(
+		tag, sizeof(tag), tileX, tileY, entry->createTime, entry->modifyCount
+	);
+	time_t date = tileDate(entry->createTime, entry->modifyTime);
+	enum kcgi_err error = tileHead(req, KHTTP_200, tag, date);
+	if (error == KCGI_HUP) return;
+	if (error) errkcgi(EX_IOERR, error, "khttp_head");
+
+	error = khttp_head(
+		req, kresps[KRESP_CONTENT_TYPE], "%s", kmimetypes[KMIME_IMAGE_PNG]
+	);
+	if (error == KCGI_HUP) return;
+	if (error) errkcgi(EX_IOERR, error, "khttp_head");
+
+	// XXX: kcgi never enables compression for FastCGI.
+	error = khttp_body(req);
+	if (error == KCGI_HUP) return;
+	if (error) errkcgi(EX_IOERR, error, "khttp_body");
+
+	error = khttp_write(req, entry->png, entry->len);
+	if (error == KCGI_HUP) return;
+	if (error) errkcgi(EX_IOERR, error, "khttp_write");
+}
+
+// Cells are sent for clients to render as a deflated header of 16-bit rows
+// and columns, 32-bit modifyCount and 64-bit createTime and modifyTime,
+// big-endian, followed by cells and colors.
+enum { CellsHeadLen = 24 };
+
+static uint8_t *cellsInt(uint8_t *ptr, uint64_t n, size_t len) {
+	for (size_t i = 0; i < len; ++i) {
+		ptr[i] = n >> 8 * (len - 1 - i);
 	}
-	return len;
+	return ptr + len;
 }
 
-static void worker(void) {
+static void pageCells(struct kreq *req) {
+	uint32_t tileX, tileY;
+	tileCoords(req, &tileX, &tileY);
+	if (tileNotModified(req, tileX, tileY)) return;
+
+	// Copy the tile so that its metadata matches its cells.
+	struct Tile tile = (*tiles)[tileY][tileX];
+	uint8_t data[CellsHeadLen + 2 * CellsSize];
+	uint8_t *ptr = data;
+	ptr = cellsInt(ptr, CellRows, 2);
+	ptr = cellsInt(ptr, CellCols, 2);
+	ptr = cellsInt(ptr, tile.modifyCount, 4);
+	ptr = cellsInt(ptr, tile.createTime, 8);
+	ptr = cellsInt(ptr, tile.modifyTime, 8);
+	memcpy(ptr, tile.cells, CellsSize);
+	memcpy(ptr + CellsSize, tile.colors, CellsSize);
+
+	uLong len = compressBound(sizeof(data));
+	uint8_t buf[len];
+	int zerror = compress(buf, &len, data, sizeof(data));
+	if (zerror != Z_OK) errx(EX_SOFTWARE, "compress: %d", zerror);
+
+	char tag[64];
+	tileTag(tag, sizeof(tag), tileX, tileY, tile.createTime, tile.modifyCount);
+	time_t date = tileDate(tile.createTime, tile.modifyTime);
+	enum kcgi_err error = tileHead(req, KHTTP_200, tag, date);
+	if (error == KCGI_HUP) return;
+	if (error) errkcgi(EX_IOERR, error, "khttp_head");
+
+	error = khttp_head(
+		req, kresps[KRESP_CONTENT_TYPE],
+		"%s", kmimetypes[KMIME_APP_OCTET_STREAM]
+	);
+	if (error == KCGI_HUP) return;
+	if (error) errkcgi(EX_IOERR, error, "khttp_head");
+
+	error = khttp_body(req);
+	if (error == KCGI_HUP) return;
+	if (error) errkcgi(EX_IOERR, error, "khttp_body");
+
+	error = khttp_write(req, (char *)buf, len);
+	if (error == KCGI_HUP) return;
+	if (error) errkcgi(EX_IOERR, error, "khttp_write");
+}
+
+// The PSF2 font is sent for clients to build glyphs from.
+static void pageFont(struct kreq *req) {
+	enum kcgi_err error = khttp_head(
+		req, kresps[KRESP_STATUS], "%s", khttps[KHTTP_200]
+	);
+	if (error == KCGI_HUP) return;
+	if (error) errkcgi(EX_IOERR, error, "khttp_head");
+
+	error = khttp_head(
+		req, kresps[KRESP_CONTENT_TYPE],
+		"%s", kmimetypes[KMIME_APP_OCTET_STREAM]
+	);
+	if (error == KCGI_HUP) return;
+	if (error) errkcgi(EX_IOERR, error, "khttp_head");
+
+	error = khttp_head(
+		req, kresps[KRESP_CACHE_CONTROL], "%s", "max-age=86400"
+	);
+	if (error == KCGI_HUP) return;
+	if (error) errkcgi(EX_IOERR, error, "khttp_head");
+
+	error = khttp_body(req);
+	if (error == KCGI_HUP) return;
+	if (error) errkcgi(EX_IOERR, error, "khttp_body");
+
+	error = khttp_write(req, (char *)&font, sizeof(font));
+	if (error == KCGI_HUP) return;
+	if (error) errkcgi(EX_IOERR, error, "khttp_write");
+
+	error = khttp_write(
+		req, (char *)glyphs, (size_t)font.glyph.len * font.glyph.size
+	);
+	if (error == KCGI_HUP) return;
+	if (error) errkcgi(EX_IOERR, error, "khttp_write");
+}
+
+static void pageStats(struct kreq *req) {
+	enum kcgi_err error = khttp_head(
+		req, kresps[KRESP_STATUS], "%s", khttps[KHTTP_200]
+	);
+	if (error == KCGI_HUP) return;
+	if (error) errkcgi(EX_IOERR, error, "khttp_head");
+
+	error = khttp_head(
+		req, kresps[KRESP_CONTENT_TYPE], "%s", kmimetypes[KMIME_TEXT_PLAIN]
+	);
+	if (error == KCGI_HUP) return;
+	if (error) errkcgi(EX_IOERR, error, "khttp_head");
+
+	error = khttp_body(req);
+	if (error == KCGI_HUP) return;
+	if (error) errkcgi(EX_IOERR, error, "khttp_body");
+
+	char *buf;
+	size_t len;
+	FILE *file = open_memstream(&buf, &len);
+	if (!file) err(EX_OSERR, "open_memstream");
+
+	fprintf(file, "# TYPE torus_image_requests_total counter\n");
+	for (size_t i = 0; i < workersLen; ++i) {
+		fprintf(
+			file, "torus_image_requests_total{worker=\"%zu\"} %ju\n",
+			i, (uintmax_t)workers[i].requests
+		);
+	}
+	fprintf(file, "# TYPE torus_image_not_modified_total counter\n");
+	for (size_t i = 0; i < workersLen; ++i) {
+		fprintf(
+			file, "torus_image_not_modified_total{worker=\"%zu\"} %ju\n",
+			i, (uintmax_t)workers[i].notModified
+		);
+	}
+	fprintf(file, "# TYPE torus_image_restarts_total counter\n");
+	for (size_t i = 0; i < workersLen; ++i) {
+		fprintf(
+			file, "torus_image_restarts_total{worker=\"%zu\"} %ju\n",
+			i, (uintmax_t)workers[i].restarts
+		);
+	}
+	fprintf(file, "# TYPE torus_image_cache_requests_total counter\n");
+	for (size_t i = 0; i < workersLen; ++i) {
+		fprintf(
+			file,
+			"torus_image_cache_requests_total"
+			"{worker=\"%zu\",result=\"hit\"} %ju\n"
+			"torus_image_cache_requests_total"
+			"{worker=\"%zu\",result=\"miss\"} %ju\n",
+			i, (uintmax_t)workers[i].hits,
+			i, (uintmax_t)workers[i].misses
+		);
+	}
+	fprintf(file, "# TYPE torus_image_cache_nanoseconds_total counter\n");
+	for (size_t i = 0; i < workersLen; ++i) {
+		fprintf(
+			file,
+			"torus_image_cache_nanoseconds_total"
+			"{worker=\"%zu\",result=\"hit\"} %ju\n"
+			"torus_image_cache_nanoseconds_total"
+			"{worker=\"%zu\",result=\"miss\"} %ju\n",
+			i, (uintmax_t)workers[i].hitNanos,
+			i, (uintmax_t)workers[i].missNanos
+		);
+	}
+	fprintf(file, "# TYPE torus_image_cache_evictions_total counter\n");
+	for (size_t i = 0; i < workersLen; ++i) {
+		fprintf(
+			file, "torus_image_cache_evictions_total{worker=\"%zu\"} %ju\n",
+			i, (uintmax_t)workers[i].evictions
+		);
+	}
+	fprintf(file, "# TYPE torus_image_cache_entries gauge\n");
+	for (size_t i = 0; i < workersLen; ++i) {
+		fprintf(
+			file, "torus_image_cache_entries{worker=\"%zu\"} %ju\n",
+			i, (uintmax_t)workers[i].entries
+		);
+	}
+	fprintf(file, "# TYPE torus_image_cache_bytes gauge\n");
+	for (size_t i = 0; i < workersLen; ++i) {
+		fprintf(
+			file, "torus_image_cache_bytes{worker=\"%zu\"} %ju\n",
+			i, (uintmax_t)workers[i].bytes
+		);
+	}
+	int fileError = fclose(file);
+	if (fileError) err(EX_OSERR, "open_memstream");
+
+	error = khttp_write(req, buf, len);
+	free(buf);
+	if (error && error != KCGI_HUP) errkcgi(EX_IOERR, error, "khttp_write");
+}
+
+static noreturn void worker(void) {
 	struct kfcgi *fcgi;
 	enum kcgi_err error = khttp_fcgi_init(
 		&fcgi, Keys, KeysLen, Pages, PagesLen, PageTile
 	);
 	if (error) errkcgi(EX_CONFIG, error, "khttp_fcgi_init");
 
+	// Termination is held off while handling a request, so that a restarted
+	// worker finishes its current request first.
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+
 	for (;;) {
 		struct kreq req;
+		sigprocmask(SIG_UNBLOCK, &mask, NULL);
 		error = khttp_fcgi_parse(fcgi, &req);
+		sigprocmask(SIG_BLOCK, &mask, NULL);
+		if (error == KCGI_EXIT) break;
 		if (error) errkcgi(EX_DATAERR, error, "khttp_fcgi_parse");
 
-		uint32_t tileX = TileInitX;
-		uint32_t tileY = TileInitY;
-		if (req.fieldmap[KeyX]) {
-			tileX = (uint32_t)req.fieldmap[KeyX]->parsed.i % TileCols;
-		}
-		if (req.fieldmap[KeyY]) {
-			tileY = (uint32_t)req.fieldmap[KeyY]->parsed.i % TileRows;
+		self->requests++;
+		switch (req.page) {
+			break; case PageStats: pageStats(&req);
+			break; case PageCells: pageCells(&req);
+			break; case PageFont:  pageFont(&req);
+			break; default:        pageTile(&req);
 		}
+		khttp_free(&req);
+	}
+	khttp_fcgi_free(fcgi);
+	exit(EX_OK);
+}
 
-		error = khttp_head(
-			&req, kresps[KRESP_STATUS], "%s", khttps[KHTTP_200]
-		);
-		if (error == KCGI_HUP) goto next;
-		if (error) errkcgi(EX_IOERR, error, "khttp_head");
+static void workerSpawn(size_t i) {
+	workers[i].restart = false;
+	workers[i].entries = 0;
+	workers[i].bytes = 0;
+	pid_t pid = fork();
+	if (pid < 0) err(EX_OSERR, "fork");
+	if (pid) {
+		workers[i].pid = pid;
+		return;
+	}
 
-		error = khttp_head(
-			&req, kresps[KRESP_CONTENT_TYPE], "%s", kmimetypes[KMIME_IMAGE_PNG]
-		);
-		if (error == KCGI_HUP) goto next;
-		if (error) errkcgi(EX_IOERR, error, "khttp_head");
+	signal(SIGHUP, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGCHLD, SIG_DFL);
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigprocmask(SIG_SETMASK, &mask, NULL);
 
-		// XXX: kcgi never enables compression for FastCGI.
-		error = khttp_body(&req);
-		if (error == KCGI_HUP) goto next;
-		if (error) errkcgi(EX_IOERR, error, "khttp_body");
+#ifdef __FreeBSD__
+	int error = cap_enter();
+	if (error) err(EX_OSERR, "cap_enter");
+#endif
 
-		struct Stream cookie = { .req = &req };
-		FILE *stream = fwopen(&cookie, streamWrite);
-		if (!stream) err(EX_OSERR, "fwopen");
+	self = &workers[i];
+	worker();
+}
 
-		render(stream, tileX, tileY);
-		fclose(stream);
+static void workersKill(void) {
+	for (size_t i = 0; i < workersLen; ++i) {
+		if (workers[i].pid) kill(workers[i].pid, SIGTERM);
+	}
+}
 
-next:
-		khttp_free(&req);
+static volatile sig_atomic_t signals[NSIG];
+static void signalHandler(int sig) {
+	signals[sig] = 1;
+}
+
+// The pool stays outside capability mode in order to signal its workers.
+// SIGHUP restarts each worker once it finishes its current request, and
+// workers which exit abnormally are restarted.
+static noreturn void pool(void) {
+	workers = mmap(
+		NULL, sizeof(*workers) * workersLen,
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0
+	);
+	if (workers == MAP_FAILED) err(EX_OSERR, "mmap");
+
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	signal(SIGHUP, signalHandler);
+	signal(SIGINT, signalHandler);
+	signal(SIGTERM, signalHandler);
+	signal(SIGCHLD, signalHandler);
+
+	for (size_t i = 0; i < workersLen; ++i) {
+		workerSpawn(i);
 	}
+
+	int status = EX_OK;
+	bool stop = false;
+	size_t live = workersLen;
+	sigemptyset(&mask);
+	while (live) {
+		sigsuspend(&mask);
+
+		if (signals[SIGINT] || signals[SIGTERM]) {
+			signals[SIGINT] = signals[SIGTERM] = 0;
+			stop = true;
+			workersKill();
+		}
+		if (signals[SIGHUP]) {
+			signals[SIGHUP] = 0;
+			for (size_t i = 0; i < workersLen; ++i) {
+				workers[i].restart = true;
+			}
+			workersKill();
+		}
+		if (!signals[SIGCHLD]) continue;
+		signals[SIGCHLD] = 0;
+
+		pid_t pid;
+		int wstatus;
+		while (0 < (pid = waitpid(-1, &wstatus, WNOHANG))) {
+			size_t i;
+			for (i = 0; i < workersLen; ++i) {
+				if (workers[i].pid == pid) break;
+			}
+			if (i == workersLen) continue;
+			workers[i].pid = 0;
+			live--;
+
+			bool clean = WIFEXITED(wstatus) && !WEXITSTATUS(wstatus);
+			if (WIFEXITED(wstatus) && WEXITSTATUS(wstatus)) {
+				warnx(
+					"worker %zu exited with status %d",
+					i, WEXITSTATUS(wstatus)
+				);
+			} else if (WIFSIGNALED(wstatus) && !workers[i].restart && !stop) {
+				warnx(
+					"worker %zu killed by signal %d",
+					i, WTERMSIG(wstatus)
+				);
+			}
+			if (WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == EX_CONFIG) {
+				status = EX_CONFIG;
+				stop = true;
+				workersKill();
+			}
+			if (stop || (clean && !workers[i].restart)) continue;
+
+			workers[i].restarts++;
+			workerSpawn(i);
+			live++;
+		}
+	}
+	exit(status);
 }
 
 #endif /* HAVE_KCGI */
@@ -260,30 +696,54 @@ int main(int argc, char *argv[]) {
 	const char *dataPath = DefaultDataPath;
 	uint32_t tileX = TileInitX;
 	uint32_t tileY = TileInitY;
+	uint32_t cols = 1;
+	uint32_t rows = 1;
 
 	int opt;
-	while (0 < (opt = getopt(argc, argv, "d:f:kx:y:"))) {
+	while (0 < (opt = getopt(argc, argv, "b:c:d:f:h:kl:n:p:w:x:y:z:"))) {
 		switch (opt) {
+			break; case 'b': renderOptions.depth = strtoul(optarg, NULL, 0);
+			break; case 'c': cacheCap = strtoul(optarg, NULL, 0) * 1024;
 			break; case 'd': dataPath = optarg;
 			break; case 'f': fontPath = optarg;
+			break; case 'h': rows = strtoul(optarg, NULL, 0);
 			break; case 'k': kcgi = true;
+			break; case 'l': renderOptions.level = strtol(optarg, NULL, 0);
+			break; case 'n': workersLen = strtoul(optarg, NULL, 0);
+			break; case 'p': renderFilterName(optarg);
+			break; case 'w': cols = strtoul(optarg, NULL, 0);
 			break; case 'x': tileX = strtoul(optarg, NULL, 0) % TileCols;
 			break; case 'y': tileY = strtoul(optarg, NULL, 0) % TileRows;
+			break; case 'z': renderStrategyName(optarg);
 			break; default:  return EX_USAGE;
 		}
 	}
+	if (renderOptions.depth != 4 && renderOptions.depth != 8) {
+		errx(EX_USAGE, "depth must be 4 or 8");
+	}
+	if (renderOptions.level < -1 || renderOptions.level > 9) {
+		errx(EX_USAGE, "level must be -1 to 9");
+	}
+	if (!cols || cols > TileCols || !rows || rows > TileRows) {
+		errx(EX_USAGE, "region must be 1 to %d tiles", TileCols);
+	}
+	if (!workersLen) errx(EX_USAGE, "workers must be positive");
 
 	fontLoad(fontPath);
 	tilesMap(dataPath);
 
+#ifdef HAVE_KCGI
+	if (kcgi) pool();
+#endif
+
 #ifdef __FreeBSD__
 	int error = cap_enter();
 	if (error) err(EX_OSERR, "cap_enter");
 #endif
 
-#ifdef HAVE_KCGI
-	if (kcgi) worker();
-#endif
-
-	render(stdout, tileX, tileY);
+	if (cols == 1 && rows == 1) {
+		render(stdout, &(*tiles)[tileY][tileX]);
+	} else {
+		renderRegion(stdout, &(*tiles)[0][0], tileX, tileY, cols, rows);
+	}
 }
@@ -0,0 +1,406 @@
+/* Copyright (C) 2019  C. McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "torus.h"
+
+static uint64_t now(void) {
+	struct timespec time;
+	int error = clock_gettime(CLOCK_MONOTONIC, &time);
+	if (error) err(EX_OSERR, "clock_gettime");
+	return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+enum Layout {
+	LayoutRows,
+	LayoutMorton,
+	LayoutsLen,
+};
+
+static const char *LayoutNames[LayoutsLen] = {
+	[LayoutRows] = "rows",
+	[LayoutMorton] = "morton",
+};
+
+static enum Layout layout = LayoutRows;
+
+// Morton order keeps each 2^n by 2^n block of tiles contiguous in the file.
+static size_t tileIndex(uint32_t tileX, uint32_t tileY) {
+	if (layout == LayoutRows) return tileY * TileRows + tileX;
+	size_t index = 0;
+	for (uint32_t bit = 0; (1u << bit) < TileCols; ++bit) {
+		index |= (size_t)(tileX >> bit & 1) << (2 * bit);
+		index |= (size_t)(tileY >> bit & 1) << (2 * bit + 1);
+	}
+	return index;
+}
+
+static const struct {
+	const char *name;
+	int advice;
+} Advice[] = {
+	{ "normal", MADV_NORMAL },
+	{ "random", MADV_RANDOM },
+	{ "sequential", MADV_SEQUENTIAL },
+	{ "willneed", MADV_WILLNEED },
+};
+
+// Only generated data files are written. Others are mapped privately, so
+// that modifications copy pages rather than reach the file.
+static int dataFd = -1;
+static bool dataShared;
+static struct Tile *tiles;
+
+static void tilesGenerate(const char *path, bool force) {
+	int flags = O_CREAT | O_RDWR | (force ? O_TRUNC : O_EXCL);
+	dataFd = open(path, flags, 0644);
+	if (dataFd < 0 && errno == EEXIST) {
+		errx(EX_CANTCREAT, "%s: exists, use -f to overwrite", path);
+	}
+	if (dataFd < 0) err(EX_CANTCREAT, "%s", path);
+	dataShared = true;
+
+	enum { ChunkLen = 64 };
+	static struct Tile chunk[ChunkLen];
+	srand(1);
+	for (size_t i = 0; i < TileRows * TileCols; i += ChunkLen) {
+		for (size_t j = 0; j < ChunkLen; ++j) {
+			chunk[j].createTime = 1;
+			for (uint8_t y = 0; y < CellRows; ++y) {
+				for (uint8_t x = 0; x < CellCols; ++x) {
+					chunk[j].cells[y][x] = ' ' + rand() % ('~' - ' ');
+					chunk[j].colors[y][x] = rand();
+				}
+			}
+		}
+		ssize_t size = write(dataFd, chunk, sizeof(chunk));
+		if (size < 0) err(EX_IOERR, "%s", path);
+		if ((size_t)size < sizeof(chunk)) {
+			errx(EX_IOERR, "%s: short write", path);
+		}
+	}
+}
+
+static void tilesOpen(const char *path) {
+	dataFd = open(path, O_RDONLY);
+	if (dataFd < 0) err(EX_NOINPUT, "%s", path);
+
+	struct stat stat;
+	int error = fstat(dataFd, &stat);
+	if (error) err(EX_IOERR, "%s", path);
+
+	if ((size_t)stat.st_size < TilesSize) {
+		errx(EX_DATAERR, "%s: truncated tiles", path);
+	}
+}
+
+static void tilesMap(int advice) {
+	tiles = mmap(
+		NULL, TilesSize, PROT_READ | PROT_WRITE,
+		(dataShared ? MAP_SHARED : MAP_PRIVATE), dataFd, 0
+	);
+	if (tiles == MAP_FAILED) err(EX_OSERR, "mmap");
+	int error = madvise(tiles, TilesSize, advice);
+	if (error) err(EX_OSERR, "madvise");
+}
+
+static void tilesUnmap(void) {
+	int error = msync(tiles, TilesSize, MS_SYNC);
+	if (error) err(EX_IOERR, "msync");
+	error = munmap(tiles, TilesSize);
+	if (error) err(EX_OSERR, "munmap");
+}
+
+// Dirty pages are written back first since they cannot be dropped.
+static void tilesDrop(void) {
+#ifdef POSIX_FADV_DONTNEED
+	int error = fsync(dataFd);
+	if (error) err(EX_IOERR, "fsync");
+	error = posix_fadvise(dataFd, 0, 0, POSIX_FADV_DONTNEED);
+	if (error) errc(EX_OSERR, error, "posix_fadvise");
+#else
+	errx(EX_UNAVAILABLE, "dropping cached data is unsupported");
+#endif
+}
+
+// Equivalents of the server's tileGet, tileAccess and tileModify.
+static struct Tile *tileGet(uint32_t tileX, uint32_t tileY) {
+	struct Tile *tile = &tiles[tileIndex(tileX, tileY)];
+	if (!tile->createTime) {
+		memset(tile->cells, ' ', CellsSize);
+		memset(tile->colors, ColorWhite, CellsSize);
+		tile->createTime = time(NULL);
+	}
+	return tile;
+}
+
+static struct Tile *tileAccess(uint32_t tileX, uint32_t tileY) {
+	struct Tile *tile = tileGet(tileX, tileY);
+	tile->accessTime = time(NULL);
+	tile->accessCount++;
+	return tile;
+}
+
+static struct Tile *tileModify(uint32_t tileX, uint32_t tileY) {
+	struct Tile *tile = tileGet(tileX, tileY);
+	tile->modifyTime = time(NULL);
+	tile->modifyCount++;
+	return tile;
+}
+
+static uint32_t sink;
+
+static void readMap(uint32_t centerX, uint32_t centerY) {
+	int32_t mapY = (int32_t)centerY - MapRows / 2;
+	int32_t mapX = (int32_t)centerX - MapCols / 2;
+	struct Map map;
+	mapInit(&map, time(NULL));
+	for (int32_t y = 0; y < MapRows; ++y) {
+		for (int32_t x = 0; x < MapCols; ++x) {
+			uint32_t tileY = ((mapY + y) % TileRows + TileRows) % TileRows;
+			uint32_t tileX = ((mapX + x) % TileCols + TileCols) % TileCols;
+			mapSet(&map, y, x, tileMeta(&tiles[tileIndex(tileX, tileY)]));
+		}
+	}
+	sink += map.max.accessCount;
+}
+
+enum Pattern {
+	PatternTele,
+	PatternWalk,
+	PatternHot,
+	PatternMap,
+	PatternScan,
+	PatternsLen,
+};
+
+static const char *PatternNames[PatternsLen] = {
+	[PatternTele] = "tele",
+	[PatternWalk] = "walk",
+	[PatternHot] = "hot",
+	[PatternMap] = "map",
+	[PatternScan] = "scan",
+};
+
+static enum Pattern pattern = PatternWalk;
+static unsigned writes = 10;
+
+enum { HotRadius = 4, HotPercent = 90 };
+
+static uint32_t wrap(int32_t n, int32_t len) {
+	return (n % len + len) % len;
+}
+
+// Walks move to a neighboring tile, hot spots are the ports and their
+// surroundings, and maps read the tiles around a random tile.
+static void step(size_t i, uint32_t *tileX, uint32_t *tileY) {
+	switch (pattern) {
+		break; case PatternTele: case PatternMap: {
+			*tileX = rand() % TileCols;
+			*tileY = rand() % TileRows;
+		}
+		break; case PatternWalk: {
+			*tileX = wrap((int32_t)*tileX + rand() % 3 - 1, TileCols);
+			*tileY = wrap((int32_t)*tileY + rand() % 3 - 1, TileRows);
+		}
+		break; case PatternHot: {
+			if ((unsigned)rand() % 100 >= HotPercent) {
+				*tileX = rand() % TileCols;
+				*tileY = rand() % TileRows;
+				break;
+			}
+			size_t port = rand() % ARRAY_LEN(Ports);
+			int32_t dx = rand() % (2 * HotRadius + 1) - HotRadius;
+			int32_t dy = rand() % (2 * HotRadius + 1) - HotRadius;
+			*tileX = wrap(Ports[port].tileX + dx, TileCols);
+			*tileY = wrap(Ports[port].tileY + dy, TileRows);
+		}
+		break; case PatternScan: {
+			*tileX = i % TileCols;
+			*tileY = i / TileCols % TileRows;
+		}
+		break; default: abort();
+	}
+}
+
+static void visit(uint32_t tileX, uint32_t tileY) {
+	if (pattern == PatternMap) {
+		readMap(tileX, tileY);
+	} else if ((unsigned)rand() % 100 < writes) {
+		struct Tile *tile = tileModify(tileX, tileY);
+		tile->cells[CellInitY][CellInitX] = '.';
+	} else {
+		sink += tileAccess(tileX, tileY)->cells[CellInitY][CellInitX];
+	}
+}
+
+static int sampleCompare(const void *_a, const void *_b) {
+	const uint64_t *a = _a, *b = _b;
+	return (*a > *b) - (*a < *b);
+}
+
+static FILE *results;
+
+static void bench(size_t run, size_t count, const char *advice, bool drop) {
+	static uint64_t *samples;
+	if (!samples) {
+		samples = malloc(sizeof(*samples) * count);
+		if (!samples) err(EX_OSERR, "malloc");
+	}
+
+	struct rusage before, after;
+	int error = getrusage(RUSAGE_SELF, &before);
+	if (error) err(EX_OSERR, "getrusage");
+
+	uint32_t tileX = TileInitX;
+	uint32_t tileY = TileInitY;
+	uint64_t total = 0;
+	for (size_t i = 0; i < count; ++i) {
+		step(i, &tileX, &tileY);
+		uint64_t start = now();
+		visit(tileX, tileY);
+		samples[i] = now() - start;
+		total += samples[i];
+	}
+
+	error = getrusage(RUSAGE_SELF, &after);
+	if (error) err(EX_OSERR, "getrusage");
+	long major = after.ru_majflt - before.ru_majflt;
+	long minor = after.ru_minflt - before.ru_minflt;
+
+	qsort(samples, count, sizeof(*samples), sampleCompare);
+	double mean = (double)total / count;
+	uint64_t p50 = samples[count / 2];
+	uint64_t p99 = samples[(size_t)(0.99 * (count - 1))];
+	uint64_t p999 = samples[(size_t)(0.999 * (count - 1))];
+	uint64_t max = samples[count - 1];
+
+	const char *cache = (drop ? "drop" : "keep");
+	printf(
+		"%-5s %-10s %-6s %2zu %-4s"
+		" %10.0f mean %10ju p50 %10ju p99 %10ju p999 %10ju max ns"
+		" %8ld major %8ld minor\n",
+		PatternNames[pattern], advice, LayoutNames[layout], run, cache,
+		mean, (uintmax_t)p50, (uintmax_t)p99, (uintmax_t)p999, (uintmax_t)max,
+		major, minor
+	);
+	if (results) {
+		fprintf(
+			results, "%s\t%s\t%s\t%zu\t%s\t%zu\t%.0f\t%ju\t%ju\t%ju\t%ju"
+			"\t%ld\t%ld\n",
+			PatternNames[pattern], advice, LayoutNames[layout], run, cache,
+			count, mean, (uintmax_t)p50, (uintmax_t)p99, (uintmax_t)p999,
+			(uintmax_t)max, major, minor
+		);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	const char *dataPath = NULL;
+	const char *resultsPath = NULL;
+	const char *adviceName = "random";
+	bool drop = false;
+	bool force = false;
+	bool generate = false;
+	size_t count = 100000;
+	size_t runs = 3;
+
+	int opt;
+	while (0 < (opt = getopt(argc, argv, "a:cd:fgl:n:o:p:r:w:"))) {
+		switch (opt) {
+			break; case 'a': adviceName = optarg;
+			break; case 'c': drop = true;
+			break; case 'd': dataPath = optarg;
+			break; case 'f': force = true;
+			break; case 'g': generate = true;
+			break; case 'l': {
+				for (layout = 0; layout < LayoutsLen; ++layout) {
+					if (!strcmp(optarg, LayoutNames[layout])) break;
+				}
+				if (layout == LayoutsLen) {
+					errx(EX_USAGE, "no layout %s", optarg);
+				}
+			}
+			break; case 'n': count = strtoul(optarg, NULL, 0);
+			break; case 'o': resultsPath = optarg;
+			break; case 'p': {
+				for (pattern = 0; pattern < PatternsLen; ++pattern) {
+					if (!strcmp(optarg, PatternNames[pattern])) break;
+				}
+				if (pattern == PatternsLen) {
+					errx(EX_USAGE, "no pattern %s", optarg);
+				}
+			}
+			break; case 'r': runs = strtoul(optarg, NULL, 0);
+			break; case 'w': writes = strtoul(optarg, NULL, 0);
+			break; default:  return EX_USAGE;
+		}
+	}
+	// The data file is never defaulted, to keep the live one out of reach.
+	if (!dataPath) errx(EX_USAGE, "data file required");
+	if (!count || writes > 100) return EX_USAGE;
+
+	size_t a;
+	for (a = 0; a < ARRAY_LEN(Advice); ++a) {
+		if (!strcmp(adviceName, Advice[a].name)) break;
+	}
+	if (a == ARRAY_LEN(Advice)) errx(EX_USAGE, "no advice %s", adviceName);
+
+	if (generate) {
+		tilesGenerate(dataPath, force);
+	} else {
+		tilesOpen(dataPath);
+	}
+
+	if (resultsPath) {
+		results = fopen(resultsPath, "w");
+		if (!results) err(EX_CANTCREAT, "%s", resultsPath);
+		fprintf(
+			results,
+			"pattern\tadvice\tlayout\trun\tcache\tcount"
+			"\tmean\tp50\tp99\tp999\tmax\tmajor\tminor\n"
+		);
+	}
+
+	// The access sequence is the same for each run, so runs after the first
+	// are warm unless cached data is dropped.
+	for (size_t run = 0; run < runs; ++run) {
+		if (drop) tilesDrop();
+		srand(1);
+		tilesMap(Advice[a].advice);
+		bench(run, count, Advice[a].name, drop);
+		tilesUnmap();
+	}
+
+	if (results) {
+		int error = fclose(results);
+		if (error) err(EX_IOERR, "%s", resultsPath);
+	}
+}
@@ -0,0 +1,575 @@
+/* Copyright (C) 2019  C. McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "torus.h"
+
+static uint64_t now(void) {
+	struct timespec time;
+	int error = clock_gettime(CLOCK_MONOTONIC, &time);
+	if (error) err(EX_OSERR, "clock_gettime");
+	return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+enum Behavior {
+	Walk,
+	Type,
+	Map,
+	Tele,
+	Crowd,
+	Idle,
+	BehaviorsLen,
+};
+
+static const char *BehaviorNames[BehaviorsLen] = {
+	[Walk] = "walk",
+	[Type] = "type",
+	[Map] = "map",
+	[Tele] = "tele",
+	[Crowd] = "crowd",
+	[Idle] = "idle",
+};
+
+static unsigned mix[BehaviorsLen] = {
+	[Walk] = 40,
+	[Type] = 30,
+	[Map] = 5,
+	[Tele] = 5,
+	[Crowd] = 20,
+};
+
+static void mixParse(char *spec) {
+	memset(mix, 0, sizeof(mix));
+	while (spec) {
+		char *weight = strsep(&spec, ",");
+		char *name = strsep(&weight, "=");
+		enum Behavior b;
+		for (b = 0; b < BehaviorsLen; ++b) {
+			if (!strcmp(name, BehaviorNames[b])) break;
+		}
+		if (b == BehaviorsLen) errx(EX_USAGE, "%s: unknown behavior", name);
+		mix[b] = (weight ? strtoul(weight, NULL, 0) : 1);
+	}
+}
+
+// Puts are tagged by their color and printable cell, so that each broadcast
+// can be matched to when and by whom it was sent.
+enum {
+	TagCells = 0x7F - ' ',
+	TagsLen = 256 * TagCells,
+};
+
+static struct {
+	uint64_t time;
+	size_t origin;
+} tags[TagsLen];
+static size_t tagNext;
+
+struct Samples {
+	uint64_t *ptr;
+	size_t len;
+	size_t cap;
+};
+
+static void samplesAdd(struct Samples *samples, uint64_t sample) {
+	if (samples->len == samples->cap) {
+		samples->cap = (samples->cap ? samples->cap * 2 : 4096);
+		samples->ptr = realloc(
+			samples->ptr, sizeof(*samples->ptr) * samples->cap
+		);
+		if (!samples->ptr) err(EX_OSERR, "realloc");
+	}
+	samples->ptr[samples->len++] = sample;
+}
+
+static int sampleCompare(const void *_a, const void *_b) {
+	const uint64_t *a = _a, *b = _b;
+	return (*a > *b) - (*a < *b);
+}
+
+static void samplesReport(const char *name, struct Samples *samples) {
+	if (!samples->len) return;
+	qsort(samples->ptr, samples->len, sizeof(*samples->ptr), sampleCompare);
+	static const struct {
+		const char *name;
+		double rank;
+	} Percentiles[] = {
+		{ "p50", 0.5 }, { "p90", 0.9 }, { "p99", 0.99 }, { "p999", 0.999 },
+	};
+	for (size_t i = 0; i < ARRAY_LEN(Percentiles); ++i) {
+		size_t index = Percentiles[i].rank * (samples->len - 1);
+		printf(
+			"%s.%s.us\t%.1f\n",
+			name, Percentiles[i].name, samples->ptr[index] / 1e3
+		);
+	}
+	printf("%s.max.us\t%.1f\n", name, samples->ptr[samples->len - 1] / 1e3);
+}
+
+static struct {
+	uint64_t sent;
+	uint64_t puts;
+	uint64_t acks;
+	uint64_t blocked;
+	uint64_t disconnects;
+	struct Samples broadcast;
+	struct Samples response;
+} stats;
+
+static_assert(sizeof(struct Map) <= sizeof(struct Tile), "map fits buffer");
+
+// Every message but a put is answered by one move, map or thumbnail sent only
+// to its sender, so the times they were sent are queued with the type of their
+// response. The first move is sent on connect, and later moves may be idle
+// probes, so it is skipped and responses must match the oldest request.
+enum { PendingLen = 64 };
+
+struct Pending {
+	uint64_t time;
+	int response;
+};
+
+static int pendingResponse(int type) {
+	switch (type) {
+		case ClientMap:   return ServerMap;
+		case ClientThumb: return ServerThumb;
+		default:          return ServerMove;
+	}
+}
+
+static struct Conn {
+	int fd;
+	bool closed;
+	bool placed;
+	enum Behavior behavior;
+	uint64_t next;
+	uint8_t cellX;
+	uint8_t cellY;
+	size_t pendingHead;
+	size_t pendingTail;
+	struct Pending pending[PendingLen];
+	size_t len;
+	uint8_t buf[sizeof(struct ServerMessage) + sizeof(struct Tile)];
+} *conns;
+static size_t connsLen;
+
+static struct pollfd *fds;
+
+static void connClose(size_t i) {
+	close(conns[i].fd);
+	conns[i].fd = -1;
+	conns[i].closed = true;
+	fds[i].fd = -1;
+}
+
+static void connResponse(size_t i, int type, uint64_t time) {
+	struct Conn *conn = &conns[i];
+	if (conn->pendingHead == conn->pendingTail) return;
+	struct Pending pending = conn->pending[conn->pendingTail % PendingLen];
+	if (pending.response != type) return;
+	conn->pendingTail++;
+	samplesAdd(&stats.response, time - pending.time);
+}
+
+static void serverPut(size_t i, struct ServerMessage msg, uint64_t time) {
+	if (msg.put.cell < ' ' || msg.put.cell >= 0x7F) return;
+	size_t tag = msg.put.color * TagCells + (msg.put.cell - ' ');
+	if (!tags[tag].time) return;
+	if (tags[tag].origin == i) {
+		stats.acks++;
+	} else {
+		samplesAdd(&stats.broadcast, time - tags[tag].time);
+	}
+}
+
+// Messages are read in bursts and parsed from a buffer, since tiles and maps
+// may arrive split across reads.
+static bool connRead(size_t i, uint64_t time) {
+	struct Conn *conn = &conns[i];
+	ssize_t size = recv(
+		conn->fd, &conn->buf[conn->len], sizeof(conn->buf) - conn->len, 0
+	);
+	if (size < 0 && errno == EAGAIN) return true;
+	if (size <= 0) return false;
+	conn->len += size;
+
+	size_t off = 0;
+	while (conn->len - off >= sizeof(struct ServerMessage)) {
+		struct ServerMessage msg;
+		memcpy(&msg, &conn->buf[off], sizeof(msg));
+
+		size_t payload = 0;
+		switch (msg.type) {
+			break; case ServerTile: payload = sizeof(struct Tile);
+			break; case ServerMap: {
+				payload = sizeof(struct Map);
+				if (conn->len - off < sizeof(msg) + payload) break;
+				connResponse(i, msg.type, time);
+			}
+			break; case ServerThumb: {
+				payload = sizeof(struct Minimap);
+				if (conn->len - off < sizeof(msg) + payload) break;
+				connResponse(i, msg.type, time);
+			}
+			break; case ServerMove: {
+				conn->cellX = msg.move.cellX;
+				conn->cellY = msg.move.cellY;
+				if (conn->placed) connResponse(i, msg.type, time);
+				conn->placed = true;
+			}
+			break; case ServerPut: serverPut(i, msg, time);
+			break; case ServerCursor:
+			break; default: return false;
+		}
+		if (conn->len - off < sizeof(msg) + payload) break;
+		off += sizeof(msg) + payload;
+	}
+
+	conn->len -= off;
+	memmove(conn->buf, &conn->buf[off], conn->len);
+	return true;
+}
+
+// Returns 1 if sent, 0 if the socket is full and -1 on error.
+static int connWrite(size_t i, struct ClientMessage msg, uint64_t time) {
+	struct Conn *conn = &conns[i];
+	ssize_t size = send(conn->fd, &msg, sizeof(msg), 0);
+	if (size < 0 && errno == EAGAIN) {
+		stats.blocked++;
+		return 0;
+	}
+	if (size != sizeof(msg)) return -1;
+
+	stats.sent++;
+	if (
+		msg.type != ClientPut &&
+		conn->pendingHead - conn->pendingTail < PendingLen
+	) {
+		conn->pending[conn->pendingHead++ % PendingLen] = (struct Pending) {
+			.time = time, .response = pendingResponse(msg.type),
+		};
+	}
+	return 1;
+}
+
+static bool connSend(size_t i, struct ClientMessage msg, uint64_t time) {
+	return connWrite(i, msg, time) >= 0;
+}
+
+static bool connPut(size_t i, uint64_t time) {
+	size_t tag = tagNext++ % TagsLen;
+	tags[tag].time = time;
+	tags[tag].origin = i;
+	struct ClientMessage msg = {
+		.type = ClientPut,
+		.put = { .color = tag / TagCells, .cell = ' ' + tag % TagCells },
+	};
+	int sent = connWrite(i, msg, time);
+	if (sent > 0) stats.puts++;
+	return sent >= 0;
+}
+
+static int8_t randomStep(uint8_t cell, uint8_t cells) {
+	int8_t step = (int8_t)arc4random_uniform(3) - 1;
+	if (cell + step < 0 || cell + step >= cells) step = -step;
+	return step;
+}
+
+static bool connAct(size_t i, uint64_t time) {
+	struct Conn *conn = &conns[i];
+	struct ClientMessage msg = { .type = ClientMove };
+	switch (conn->behavior) {
+		break; case Walk: {
+			msg.move.dx = (int8_t)arc4random_uniform(3) - 1;
+			msg.move.dy = (int8_t)arc4random_uniform(3) - 1;
+		}
+		break; case Type: {
+			if (!connPut(i, time)) return false;
+			msg.move.dx = 1;
+		}
+		break; case Map: msg.type = ClientMap;
+		break; case Tele: {
+			msg.type = ClientTele;
+			msg.port = arc4random_uniform(ARRAY_LEN(Ports));
+		}
+		break; case Crowd: {
+			if (!connPut(i, time)) return false;
+			msg.move.dx = randomStep(conn->cellX, CellCols);
+			msg.move.dy = randomStep(conn->cellY, CellRows);
+		}
+		break; default: return true;
+	}
+	return connSend(i, msg, time);
+}
+
+static int connOpen(const char *path) {
+	int fd = socket(PF_LOCAL, SOCK_STREAM, 0);
+	if (fd < 0) err(EX_OSERR, "socket");
+
+	struct sockaddr_un addr = { .sun_family = AF_LOCAL };
+	strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+	int error = connect(fd, (struct sockaddr *)&addr, SUN_LEN(&addr));
+	if (error) err(EX_NOINPUT, "%s", path);
+
+	int on = 1;
+	error = setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+	if (error) err(EX_OSERR, "setsockopt");
+
+	error = fcntl(fd, F_SETFL, O_NONBLOCK);
+	if (error) err(EX_OSERR, "fcntl");
+	return fd;
+}
+
+static void report(uint64_t elapsed) {
+	double seconds = elapsed / 1e9;
+	printf("seconds\t%.3f\n", seconds);
+	printf("sent\t%ju\n", (uintmax_t)stats.sent);
+	printf("sent/s\t%.1f\n", stats.sent / seconds);
+	printf("puts\t%ju\n", (uintmax_t)stats.puts);
+	printf("puts.acked\t%ju\n", (uintmax_t)stats.acks);
+	printf("puts/s\t%.1f\n", stats.acks / seconds);
+	printf("deliveries\t%zu\n", stats.broadcast.len);
+	printf("deliveries/s\t%.1f\n", stats.broadcast.len / seconds);
+	printf("blocked\t%ju\n", (uintmax_t)stats.blocked);
+	printf("disconnects\t%ju\n", (uintmax_t)stats.disconnects);
+	samplesReport("latency", &stats.broadcast);
+	samplesReport("response", &stats.response);
+}
+
+static void readAll(uint64_t time, int nfds) {
+	for (size_t i = 0; nfds && i < connsLen; ++i) {
+		if (fds[i].fd < 0 || !fds[i].revents) continue;
+		nfds--;
+		if (!connRead(i, time)) {
+			connClose(i);
+			stats.disconnects++;
+		}
+	}
+}
+
+static struct Trace *records;
+static size_t recordsLen;
+
+static void traceLoad(const char *path) {
+	FILE *file = fopen(path, "r");
+	if (!file) err(EX_NOINPUT, "%s", path);
+
+	struct stat stat;
+	int error = fstat(fileno(file), &stat);
+	if (error) err(EX_IOERR, "%s", path);
+	if (stat.st_size % sizeof(*records)) {
+		errx(EX_DATAERR, "%s: truncated trace", path);
+	}
+
+	recordsLen = stat.st_size / sizeof(*records);
+	records = malloc(sizeof(*records) * recordsLen);
+	if (!records) err(EX_OSERR, "malloc");
+	size_t len = fread(records, sizeof(*records), recordsLen, file);
+	if (ferror(file)) err(EX_IOERR, "%s", path);
+	if (len < recordsLen) errx(EX_DATAERR, "%s: truncated trace", path);
+	fclose(file);
+
+	for (size_t r = 0; r < recordsLen; ++r) {
+		if (records[r].conn >= connsLen) connsLen = records[r].conn + 1;
+	}
+	conns = calloc(connsLen, sizeof(*conns));
+	if (!conns) err(EX_OSERR, "calloc");
+	fds = calloc(connsLen, sizeof(*fds));
+	if (!fds) err(EX_OSERR, "calloc");
+	for (size_t i = 0; i < connsLen; ++i) {
+		conns[i].fd = -1;
+		fds[i].fd = -1;
+	}
+}
+
+// Returns false if the record must be retried once the socket drains.
+// Messages from connections recorded before the trace started open them.
+static bool replayRecord(const char *path, const struct Trace *record) {
+	size_t i = record->conn;
+	struct Conn *conn = &conns[i];
+	if (record->type == TraceDisconnect) {
+		if (conn->fd >= 0) connClose(i);
+		return true;
+	}
+	if (conn->closed) return true;
+	if (conn->fd < 0) {
+		conn->fd = connOpen(path);
+		fds[i] = (struct pollfd) { .fd = conn->fd, .events = POLLIN };
+	}
+	if (record->type != TraceMessage) return true;
+
+	int sent = connWrite(i, record->msg, now());
+	if (sent < 0) {
+		connClose(i);
+		stats.disconnects++;
+	}
+	if (record->msg.type == ClientPut && sent > 0) stats.puts++;
+	return sent != 0;
+}
+
+// Records are sent at their recorded times divided by speed, or as fast as
+// the server accepts them if speed is zero, then responses are awaited.
+static void replay(const char *path, double speed) {
+	uint64_t start = now();
+	uint64_t drain = 0;
+	size_t r = 0;
+	for (;;) {
+		uint64_t time = now();
+		uint64_t due = 0;
+		bool blocked = false;
+		for (; r < recordsLen; ++r) {
+			if (speed) {
+				due = start + records[r].time / speed;
+				if (due > time) break;
+			}
+			if (!replayRecord(path, &records[r])) {
+				blocked = true;
+				break;
+			}
+		}
+
+		int timeout = 1000;
+		if (r < recordsLen) {
+			timeout = (due > time ? (due - time + 999999) / 1000000 : 0);
+			if (blocked) timeout = 1;
+		} else if (!drain) {
+			drain = now();
+		} else if (time - drain > 1000000000) {
+			break;
+		}
+
+		int nfds = poll(fds, connsLen, timeout);
+		if (nfds < 0) err(EX_IOERR, "poll");
+		readAll(now(), nfds);
+	}
+
+	printf("records\t%zu\n", recordsLen);
+	if (recordsLen) {
+		printf(
+			"recorded.seconds\t%.3f\n", records[recordsLen - 1].time / 1e9
+		);
+	}
+	report(drain - start);
+}
+
+int main(int argc, char *argv[]) {
+	const char *sockPath = DefaultSockPath;
+	const char *tracePath = NULL;
+	size_t count = 100;
+	uint64_t interval = 100;
+	uint64_t duration = 10;
+	double speed = 1;
+	int opt;
+	while (0 < (opt = getopt(argc, argv, "i:m:n:r:s:t:x:"))) {
+		switch (opt) {
+			break; case 'i': interval = strtoull(optarg, NULL, 0);
+			break; case 'm': mixParse(optarg);
+			break; case 'n': count = strtoul(optarg, NULL, 0);
+			break; case 'r': tracePath = optarg;
+			break; case 's': sockPath = optarg;
+			break; case 't': duration = strtoull(optarg, NULL, 0);
+			break; case 'x': speed = strtod(optarg, NULL);
+			break; default:  return EX_USAGE;
+		}
+	}
+	if (!count || !interval || speed < 0) return EX_USAGE;
+
+	if (tracePath) {
+		traceLoad(tracePath);
+		replay(sockPath, speed);
+		return EX_OK;
+	}
+	interval *= 1000000;
+	duration *= 1000000000;
+
+	unsigned total = 0;
+	for (enum Behavior b = 0; b < BehaviorsLen; ++b) total += mix[b];
+	if (!total) errx(EX_USAGE, "empty mix");
+
+	conns = calloc(count, sizeof(*conns));
+	if (!conns) err(EX_OSERR, "calloc");
+	fds = calloc(count, sizeof(*fds));
+	if (!fds) err(EX_OSERR, "calloc");
+
+	// Behaviors are assigned in proportion to their weights, and actions are
+	// spread evenly over the first interval.
+	for (connsLen = 0; connsLen < count; ++connsLen) {
+		struct Conn *conn = &conns[connsLen];
+		unsigned weight = connsLen * total / count;
+		enum Behavior b;
+		for (b = 0; b < BehaviorsLen - 1; ++b) {
+			if (weight < mix[b]) break;
+			weight -= mix[b];
+		}
+		conn->behavior = b;
+		conn->fd = connOpen(sockPath);
+		fds[connsLen] = (struct pollfd) { .fd = conn->fd, .events = POLLIN };
+	}
+
+	uint64_t start = now();
+	for (size_t i = 0; i < connsLen; ++i) {
+		conns[i].next = start + arc4random_uniform(interval);
+	}
+	for (uint64_t time = start; time - start < duration; time = now()) {
+		uint64_t next = start + duration;
+		for (size_t i = 0; i < connsLen; ++i) {
+			if (fds[i].fd < 0) continue;
+			if (conns[i].next <= time) {
+				if (!connAct(i, time)) {
+					connClose(i);
+					stats.disconnects++;
+					continue;
+				}
+				conns[i].next += interval;
+				if (conns[i].next <= time) conns[i].next = time + interval;
+			}
+			if (conns[i].next < next) next = conns[i].next;
+		}
+
+		time = now();
+		int timeout = (next > time ? (next - time + 999999) / 1000000 : 0);
+		int nfds = poll(fds, connsLen, timeout);
+		if (nfds < 0) err(EX_IOERR, "poll");
+
+		readAll(now(), nfds);
+	}
+
+	printf("clients\t%zu\n", connsLen);
+	for (enum Behavior b = 0; b < BehaviorsLen; ++b) {
+		size_t len = 0;
+		for (size_t i = 0; i < connsLen; ++i) {
+			if (conns[i].behavior == b) len++;
+		}
+		if (len) printf("clients.%s\t%zu\n", BehaviorNames[b], len);
+	}
+	report(now() - start);
+	return EX_OK;
+}
@@ -20,25 +20,86 @@
 #include <stdlib.h>
 #include <sysexits.h>
 
-static inline uint32_t pngCRCTable(uint8_t n) {
-	static uint32_t table[256];
-	if (table[1]) return table[n];
-	for (int i = 0; i < 256; ++i) {
-		table[i] = i;
+// CRCs are taken eight bytes at a time, each table extending the one before
+// it by a zero byte.
+static uint32_t pngCRCTables[8][256];
+
+// The tables are built on first use, so threads must build them before they
+// share them.
+static inline void pngCRCInit(void) {
+	if (pngCRCTables[7][255]) return;
+	for (uint32_t i = 0; i < 256; ++i) {
+		uint32_t crc = i;
 		for (int j = 0; j < 8; ++j) {
-			table[i] = (table[i] >> 1) ^ (table[i] & 1 ? 0xEDB88320 : 0);
+			crc = (crc >> 1) ^ (crc & 1 ? 0xEDB88320 : 0);
+		}
+		pngCRCTables[0][i] = crc;
+	}
+	for (uint32_t i = 0; i < 256; ++i) {
+		for (int k = 1; k < 8; ++k) {
+			uint32_t crc = pngCRCTables[k - 1][i];
+			pngCRCTables[k][i] = (crc >> 8) ^ pngCRCTables[0][crc & 0xFF];
+		}
+	}
+}
+
+static inline uint32_t pngCRCUpdate(
+	uint32_t crc, const uint8_t *ptr, size_t len
+) {
+	pngCRCInit();
+	uint32_t (*table)[256] = pngCRCTables;
+	for (; len >= 8; ptr += 8, len -= 8) {
+		uint32_t lo = crc
+			^ ((uint32_t)ptr[0] | (uint32_t)ptr[1] << 8
+			| (uint32_t)ptr[2] << 16 | (uint32_t)ptr[3] << 24);
+		uint32_t hi = (uint32_t)ptr[4] | (uint32_t)ptr[5] << 8
+			| (uint32_t)ptr[6] << 16 | (uint32_t)ptr[7] << 24;
+		crc = table[7][lo & 0xFF] ^ table[6][lo >> 8 & 0xFF]
+			^ table[5][lo >> 16 & 0xFF] ^ table[4][lo >> 24]
+			^ table[3][hi & 0xFF] ^ table[2][hi >> 8 & 0xFF]
+			^ table[1][hi >> 16 & 0xFF] ^ table[0][hi >> 24];
+	}
+	for (; len; ++ptr, --len) {
+		crc = table[0][(crc ^ *ptr) & 0xFF] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+// Sums are reduced only every 5552 bytes, the most that cannot overflow, and
+// taken in blocks of 16 with fixed weights so that they vectorize.
+static inline uint32_t pngAdler(
+	uint32_t adler, const uint8_t *ptr, size_t len
+) {
+	enum { Mod = 65521, Max = 5552, Block = 16 };
+	uint32_t a = adler & 0xFFFF, b = adler >> 16;
+	while (len) {
+		size_t n = (len < Max ? len : Max);
+		len -= n;
+		for (; n >= Block; ptr += Block, n -= Block) {
+			uint32_t sum = 0, weighted = 0;
+			for (int i = 0; i < Block; ++i) {
+				sum += ptr[i];
+				weighted += (Block - i) * (uint32_t)ptr[i];
+			}
+			b += Block * a + weighted;
+			a += sum;
+		}
+		for (; n; ++ptr, --n) {
+			a += *ptr;
+			b += a;
 		}
+		a %= Mod;
+		b %= Mod;
 	}
-	return table[n];
+	return b << 16 | a;
 }
 
-static uint32_t pngCRC;
+// The running CRC is per thread so that threads can write PNGs at once.
+static _Thread_local uint32_t pngCRC;
 
 static inline void pngWrite(FILE *file, const uint8_t *ptr, uint32_t len) {
 	if (!fwrite(ptr, len, 1, file)) err(EX_IOERR, "pngWrite");
-	for (uint32_t i = 0; i < len; ++i) {
-		pngCRC = pngCRCTable(pngCRC ^ ptr[i]) ^ (pngCRC >> 8);
-	}
+	pngCRC = pngCRCUpdate(pngCRC, ptr, len);
 }
 static inline void pngInt32(FILE *file, uint32_t n) {
 	pngWrite(file, (uint8_t []) { n >> 24, n >> 16, n >> 8, n }, 4);
@@ -84,11 +145,7 @@ enum {
 };
 
 static inline void pngData(FILE *file, const uint8_t *data, uint32_t len) {
-	uint32_t adler1 = 1, adler2 = 0;
-	for (uint32_t i = 0; i < len; ++i) {
-		adler1 = (adler1 + data[i]) % 65521;
-		adler2 = (adler1 + adler2) % 65521;
-	}
+	uint32_t adler = pngAdler(1, data, len);
 	uint32_t zlen = 2 + 5 * ((len + 0xFFFE) / 0xFFFF) + len + 4;
 	pngChunk(file, "IDAT", zlen);
 	pngWrite(file, (uint8_t []) { 0x08, 0x1D }, 2);
@@ -98,7 +155,7 @@ static inline void pngData(FILE *file, const uint8_t *data, uint32_t len) {
 	}
 	pngWrite(file, (uint8_t []) { 0x01, len, len >> 8, ~len, ~len >> 8 }, 5);
 	pngWrite(file, data, len);
-	pngInt32(file, adler2 << 16 | adler1);
+	pngInt32(file, adler);
 	pngInt32(file, ~pngCRC);
 }
 
@@ -108,6 +165,76 @@ static inline void pngDeflated(FILE *file, const uint8_t *data, uint32_t len) {
 	pngInt32(file, ~pngCRC);
 }
 
+// Deflated data of unknown length is collected in place and written as an
+// IDAT chunk each time the buffer fills.
+enum { PNGBufferCap = 64 * 1024 };
+struct PNGBuffer {
+	FILE *file;
+	uint32_t len;
+	uint8_t ptr[PNGBufferCap];
+};
+
+static inline void pngBufferFlush(struct PNGBuffer *buf) {
+	if (!buf->len) return;
+	pngDeflated(buf->file, buf->ptr, buf->len);
+	buf->len = 0;
+}
+
+static inline void pngTransparency(
+	FILE *file, const uint8_t *alpha, uint32_t len
+) {
+	pngChunk(file, "tRNS", len);
+	pngWrite(file, alpha, len);
+	pngInt32(file, ~pngCRC);
+}
+
+// Animated PNG chunks share one sequence number, counted from 0.
+static inline void pngAnimation(FILE *file, uint32_t frames, uint32_t plays) {
+	pngChunk(file, "acTL", 8);
+	pngInt32(file, frames);
+	pngInt32(file, plays);
+	pngInt32(file, ~pngCRC);
+}
+
+enum {
+	PNGDisposeNone,
+	PNGDisposeBackground,
+	PNGDisposePrevious,
+};
+
+enum {
+	PNGBlendSource,
+	PNGBlendOver,
+};
+
+static inline void pngFrame(
+	FILE *file, uint32_t seq, uint32_t width, uint32_t height,
+	uint32_t x, uint32_t y, uint16_t delayNum, uint16_t delayDen,
+	uint8_t dispose, uint8_t blend
+) {
+	pngChunk(file, "fcTL", 26);
+	pngInt32(file, seq);
+	pngInt32(file, width);
+	pngInt32(file, height);
+	pngInt32(file, x);
+	pngInt32(file, y);
+	pngWrite(
+		file, (uint8_t []) {
+			delayNum >> 8, delayNum, delayDen >> 8, delayDen, dispose, blend
+		}, 6
+	);
+	pngInt32(file, ~pngCRC);
+}
+
+static inline void pngFrameDeflated(
+	FILE *file, uint32_t seq, const uint8_t *data, uint32_t len
+) {
+	pngChunk(file, "fdAT", 4 + len);
+	pngInt32(file, seq);
+	pngWrite(file, data, len);
+	pngInt32(file, ~pngCRC);
+}
+
 static inline void pngTail(FILE *file) {
 	pngChunk(file, "IEND", 0);
 	pngInt32(file, ~pngCRC);
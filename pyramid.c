@@ -0,0 +1,291 @@
+/* Copyright (C) 2019  C. McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "png.h"
+#include "torus.h"
+#include "render.h"
+
+// Zoom level z covers the torus in 2^z by 2^z images the size of a tile.
+enum { ZoomMax = 9 };
+static_assert(TileCols == 1 << ZoomMax, "zoom levels cover tile columns");
+static_assert(TileRows == TileCols, "zoom levels cover square torus");
+
+static struct Tile (*tiles)[TileRows][TileCols];
+
+static void tilesMap(const char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) err(EX_NOINPUT, "%s", path);
+
+	struct stat stat;
+	int error = fstat(fd, &stat);
+	if (error) err(EX_IOERR, "%s", path);
+
+	if ((size_t)stat.st_size < TilesSize) {
+		errx(EX_DATAERR, "%s: truncated tiles", path);
+	}
+
+	tiles = mmap(NULL, TilesSize, PROT_READ, MAP_SHARED, fd, 0);
+	if (tiles == MAP_FAILED) err(EX_OSERR, "mmap");
+	close(fd);
+}
+
+// Each image is stamped with the latest creation or modification time of
+// the tiles it covers, or 0 if none have been created. Written images take
+// their stamp as modification time, so that on later runs only images
+// whose stamp has advanced are rendered again.
+static time_t *stamps[ZoomMax + 1];
+
+static time_t *stamp(uint32_t zoom, uint32_t x, uint32_t y) {
+	return &stamps[zoom][y << zoom | x];
+}
+
+static void stampsBuild(void) {
+	for (uint32_t zoom = 0; zoom <= ZoomMax; ++zoom) {
+		stamps[zoom] = calloc((size_t)1 << zoom << zoom, sizeof(time_t));
+		if (!stamps[zoom]) err(EX_OSERR, "calloc");
+	}
+
+	int error = madvise(tiles, TilesSize, MADV_SEQUENTIAL);
+	if (error) err(EX_OSERR, "madvise");
+	for (uint32_t y = 0; y < TileRows; ++y) {
+		for (uint32_t x = 0; x < TileCols; ++x) {
+			const struct Tile *tile = &(*tiles)[y][x];
+			if (!tile->createTime) continue;
+			*stamp(ZoomMax, x, y) = (tile->modifyTime > tile->createTime)
+				? tile->modifyTime
+				: tile->createTime;
+		}
+	}
+	error = madvise(tiles, TilesSize, MADV_NORMAL);
+	if (error) err(EX_OSERR, "madvise");
+
+	for (uint32_t zoom = ZoomMax; zoom > 0; --zoom) {
+		for (uint32_t y = 0; y < 1U << zoom; ++y) {
+			for (uint32_t x = 0; x < 1U << zoom; ++x) {
+				time_t *parent = stamp(zoom - 1, x / 2, y / 2);
+				time_t child = *stamp(zoom, x, y);
+				if (child > *parent) *parent = child;
+			}
+		}
+	}
+}
+
+static const char *outPath;
+
+static void dirsMake(void) {
+	char path[PATH_MAX];
+	for (uint32_t zoom = 0; zoom <= ZoomMax; ++zoom) {
+		snprintf(path, sizeof(path), "%s/%u", outPath, zoom);
+		int error = mkdir(path, 0755);
+		if (error && errno != EEXIST) err(EX_CANTCREAT, "%s", path);
+		for (uint32_t x = 0; x < 1U << zoom; ++x) {
+			uint32_t y;
+			for (y = 0; y < 1U << zoom; ++y) {
+				if (*stamp(zoom, x, y)) break;
+			}
+			if (y == 1U << zoom) continue;
+			snprintf(path, sizeof(path), "%s/%u/%u", outPath, zoom, x);
+			error = mkdir(path, 0755);
+			if (error && errno != EEXIST) err(EX_CANTCREAT, "%s", path);
+		}
+	}
+}
+
+// Below full resolution, each pixel takes the color of the cell at its
+// center, as cells appear in thumbnails.
+static void renderZoom(uint8_t *ptr, uint32_t zoom, uint32_t x, uint32_t y) {
+	uint32_t width = renderWidth();
+	uint32_t height = renderHeight();
+	uint32_t scale = 1 << (ZoomMax - zoom);
+	uint8_t (*data)[1 + width] = (void *)ptr;
+
+	uint32_t tileXs[width];
+	uint8_t cellXs[width];
+	for (uint32_t px = 0; px < width; ++px) {
+		uint32_t col = (2 * px + 1) * scale / (2 * font.glyph.width);
+		tileXs[px] = x * scale + col / CellCols;
+		cellXs[px] = col % CellCols;
+	}
+	for (uint32_t py = 0; py < height; ++py) {
+		uint32_t row = (2 * py + 1) * scale / (2 * font.glyph.height);
+		uint32_t tileY = y * scale + row / CellRows;
+		uint8_t cellY = row % CellRows;
+		data[py][0] = PNGNone;
+		for (uint32_t px = 0; px < width; ++px) {
+			const struct Tile *tile = &(*tiles)[tileY][tileXs[px]];
+			data[py][1 + px] = cellColor(
+				tile->cells[cellY][cellXs[px]], tile->colors[cellY][cellXs[px]]
+			);
+		}
+	}
+}
+
+static atomic_uint rendered[ZoomMax + 1];
+static atomic_uint unchanged[ZoomMax + 1];
+
+static void export(uint8_t *ptr, uint32_t zoom, uint32_t x, uint32_t y) {
+	time_t time = *stamp(zoom, x, y);
+	if (!time) return;
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%u/%u/%u.png", outPath, zoom, x, y);
+	struct stat stat;
+	int error = lstat(path, &stat);
+	if (!error && stat.st_mtime >= time) {
+		unchanged[zoom]++;
+		return;
+	}
+	if (error && errno != ENOENT) err(EX_IOERR, "%s", path);
+
+	char temp[PATH_MAX + sizeof(".tmp")];
+	snprintf(temp, sizeof(temp), "%s.tmp", path);
+	FILE *file = fopen(temp, "w");
+	if (!file) err(EX_CANTCREAT, "%s", temp);
+
+	if (zoom == ZoomMax) {
+		renderRaster(ptr, &(*tiles)[y][x]);
+	} else {
+		renderZoom(ptr, zoom, x, y);
+	}
+	renderEncode(file, ptr);
+
+	error = fflush(file);
+	if (error) err(EX_IOERR, "%s", temp);
+	struct timespec times[2] = { { .tv_sec = time }, { .tv_sec = time } };
+	error = futimens(fileno(file), times);
+	if (error) err(EX_IOERR, "%s", temp);
+	error = fclose(file);
+	if (error) err(EX_IOERR, "%s", temp);
+
+	error = rename(temp, path);
+	if (error) err(EX_CANTCREAT, "%s", path);
+	rendered[zoom]++;
+}
+
+// Workers take images in order from full resolution down, so that the first
+// and largest level reads the data file sequentially.
+static atomic_uint_fast64_t next;
+
+static void *worker(void *arg) {
+	(void)arg;
+	uint8_t *ptr = malloc((size_t)renderHeight() * (1 + renderWidth()));
+	if (!ptr) err(EX_OSERR, "malloc");
+	for (;;) {
+		uint64_t job = next++;
+		uint32_t zoom;
+		for (zoom = ZoomMax + 1; zoom-- > 0;) {
+			uint64_t count = (uint64_t)1 << zoom << zoom;
+			if (job < count) break;
+			job -= count;
+		}
+		if (zoom > ZoomMax) break;
+		export(ptr, zoom, job & ((1 << zoom) - 1), job >> zoom);
+	}
+	free(ptr);
+	return NULL;
+}
+
+int main(int argc, char *argv[]) {
+	const char *dataPath = DefaultDataPath;
+	const char *fontPath = DefaultFontPath;
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	outPath = "tiles";
+
+	int opt;
+	while (0 < (opt = getopt(argc, argv, "b:d:f:j:l:o:p:z:"))) {
+		switch (opt) {
+			break; case 'b': renderOptions.depth = strtoul(optarg, NULL, 0);
+			break; case 'd': dataPath = optarg;
+			break; case 'f': fontPath = optarg;
+			break; case 'j': jobs = strtol(optarg, NULL, 0);
+			break; case 'l': renderOptions.level = strtol(optarg, NULL, 0);
+			break; case 'o': outPath = optarg;
+			break; case 'p': renderFilterName(optarg);
+			break; case 'z': renderStrategyName(optarg);
+			break; default:  return EX_USAGE;
+		}
+	}
+	if (jobs < 1) errx(EX_USAGE, "jobs must be positive");
+	if (renderOptions.depth != 4 && renderOptions.depth != 8) {
+		errx(EX_USAGE, "depth must be 4 or 8");
+	}
+	if (renderOptions.level < -1 || renderOptions.level > 9) {
+		errx(EX_USAGE, "level must be -1 to 9");
+	}
+
+	fontLoad(fontPath);
+	tilesMap(dataPath);
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	stampsBuild();
+	int error = mkdir(outPath, 0755);
+	if (error && errno != EEXIST) err(EX_CANTCREAT, "%s", outPath);
+	dirsMake();
+
+	// The CRC tables are built on first use, so build them before threads
+	// share them. Encoding keeps a deflated copy of a tile on the stack.
+	pngCRCInit();
+	pthread_attr_t attr;
+	error = pthread_attr_init(&attr);
+	if (error) errc(EX_OSERR, error, "pthread_attr_init");
+	size_t stack = 1024 * 1024 + 3 * (size_t)renderHeight() * renderWidth();
+	error = pthread_attr_setstacksize(&attr, stack);
+	if (error) errc(EX_OSERR, error, "pthread_attr_setstacksize");
+
+	pthread_t threads[jobs];
+	for (long i = 0; i < jobs; ++i) {
+		error = pthread_create(&threads[i], &attr, worker, NULL);
+		if (error) errc(EX_OSERR, error, "pthread_create");
+	}
+	for (long i = 0; i < jobs; ++i) {
+		error = pthread_join(threads[i], NULL);
+		if (error) errc(EX_OSERR, error, "pthread_join");
+	}
+
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	for (uint32_t zoom = 0; zoom <= ZoomMax; ++zoom) {
+		printf(
+			"%u\t%u rendered\t%u unchanged\n",
+			zoom, atomic_load(&rendered[zoom]), atomic_load(&unchanged[zoom])
+		);
+	}
+	printf(
+		"%.3f seconds with %ld jobs\n",
+		(double)(end.tv_sec - start.tv_sec)
+			+ (double)(end.tv_nsec - start.tv_nsec) / 1e9,
+		jobs
+	);
+}
@@ -0,0 +1,434 @@
+/* Copyright (C) 2018, 2019  C. McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <zlib.h>
+
+static const uint8_t Palette[16][3] = {
+	{ 0x00, 0x00, 0x00 },
+	{ 0xAA, 0x00, 0x00 },
+	{ 0x00, 0xAA, 0x00 },
+	{ 0xAA, 0x55, 0x00 },
+	{ 0x00, 0x00, 0xAA },
+	{ 0xAA, 0x00, 0xAA },
+	{ 0x00, 0xAA, 0xAA },
+	{ 0xAA, 0xAA, 0xAA },
+	{ 0x55, 0x55, 0x55 },
+	{ 0xFF, 0x55, 0x55 },
+	{ 0x55, 0xFF, 0x55 },
+	{ 0xFF, 0xFF, 0x55 },
+	{ 0x55, 0x55, 0xFF },
+	{ 0xFF, 0x55, 0xFF },
+	{ 0x55, 0xFF, 0xFF },
+	{ 0xFF, 0xFF, 0xFF },
+};
+
+static struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint32_t flags;
+	struct {
+		uint32_t len;
+		uint32_t size;
+		uint32_t height;
+		uint32_t width;
+	} glyph;
+} font;
+
+static uint8_t *glyphs;
+
+// Glyph bits are expanded at load into a byte per pixel, 0xFF where set, so
+// that rows of pixels are blended whole rather than bit by bit.
+static uint8_t *glyphMasks;
+
+static inline void fontLoad(const char *path) {
+	FILE *file = fopen(path, "r");
+	if (!file) err(EX_NOINPUT, "%s", path);
+
+	size_t len = fread(&font, sizeof(font), 1, file);
+	if (ferror(file)) err(EX_IOERR, "%s", path);
+	if (len < 1) errx(EX_DATAERR, "%s: truncated header", path);
+
+	if (font.magic != 0x864AB572 || font.size != sizeof(font)) {
+		errx(EX_DATAERR, "%s: invalid header", path);
+	}
+
+	glyphs = calloc(font.glyph.len, font.glyph.size);
+	if (!glyphs) err(EX_OSERR, "calloc");
+
+	len = fread(glyphs, font.glyph.size, font.glyph.len, file);
+	if (ferror(file)) err(EX_IOERR, "%s", path);
+	if (len < font.glyph.len) errx(EX_DATAERR, "%s: truncated glyphs", path);
+	fclose(file);
+
+	uint32_t widthBytes = (font.glyph.width + 7) / 8;
+	uint8_t (*bits)[font.glyph.len][font.glyph.height][widthBytes];
+	bits = (void *)glyphs;
+
+	uint8_t (*masks)[font.glyph.len][font.glyph.height][font.glyph.width];
+	masks = calloc(1, sizeof(*masks));
+	if (!masks) err(EX_OSERR, "calloc");
+	for (uint32_t i = 0; i < font.glyph.len; ++i) {
+		for (uint32_t y = 0; y < font.glyph.height; ++y) {
+			for (uint32_t x = 0; x < font.glyph.width; ++x) {
+				uint8_t bit = (*bits)[i][y][x / 8] >> (7 - x % 8) & 1;
+				(*masks)[i][y][x] = -bit;
+			}
+		}
+	}
+	glyphMasks = (uint8_t *)masks;
+}
+
+static inline uint32_t renderWidth(void) {
+	return CellCols * font.glyph.width;
+}
+static inline uint32_t renderHeight(void) {
+	return CellRows * font.glyph.height;
+}
+
+// Rasterizes glyph row y of the cells in row cellY of a tile into
+// CellCols * font.glyph.width pixels, each glyph row blended as
+// bg ^ (fg ^ bg) under its mask, eight pixels at a time for 8-pixel-wide
+// fonts.
+static inline void renderRow(
+	uint8_t *row, const struct Tile *tile, uint32_t cellY, uint32_t y
+) {
+	uint32_t width = font.glyph.width;
+	uint32_t height = font.glyph.height;
+	uint8_t (*masks)[font.glyph.len][height][width] = (void *)glyphMasks;
+	for (uint32_t cellX = 0; cellX < CellCols; ++cellX) {
+		const uint8_t *mask = (*masks)[tile->cells[cellY][cellX]][y];
+		uint8_t fg = tile->colors[cellY][cellX] & 0x0F;
+		uint8_t bg = tile->colors[cellY][cellX] >> 4;
+		if (width == 8) {
+			uint64_t bits;
+			memcpy(&bits, mask, sizeof(bits));
+			uint64_t pixels = 0x0101010101010101 * bg;
+			pixels ^= 0x0101010101010101 * (fg ^ bg) & bits;
+			memcpy(row, &pixels, sizeof(pixels));
+		} else {
+			for (uint32_t x = 0; x < width; ++x) {
+				row[x] = bg ^ ((fg ^ bg) & mask[x]);
+			}
+		}
+		row += width;
+	}
+}
+
+// Rasterizes a tile into PNG scanlines of 1 + renderWidth() bytes each.
+static inline void renderRaster(uint8_t *ptr, const struct Tile *tile) {
+	uint8_t (*data)[1 + renderWidth()] = (void *)ptr;
+	for (uint32_t cellY = 0; cellY < CellRows; ++cellY) {
+		for (uint32_t y = 0; y < font.glyph.height; ++y) {
+			uint8_t *row = data[cellY * font.glyph.height + y];
+			row[0] = PNGNone;
+			renderRow(&row[1], tile, cellY, y);
+		}
+	}
+}
+
+// Scanlines are packed to 4 bits per pixel by default, then filtered, with
+// RenderAdaptive choosing per row the filter with the least sum of absolute
+// differences, and deflated with the chosen level and strategy.
+enum { RenderAdaptive = PNGPaeth + 1 };
+
+static const char *RenderFilterNames[] = {
+	[PNGNone] = "none",
+	[PNGSub] = "sub",
+	[PNGUp] = "up",
+	[PNGAverage] = "average",
+	[PNGPaeth] = "paeth",
+	[RenderAdaptive] = "adaptive",
+};
+
+static const struct {
+	const char *name;
+	int strategy;
+} RenderStrategies[] = {
+	{ "default", Z_DEFAULT_STRATEGY },
+	{ "filtered", Z_FILTERED },
+	{ "huffman", Z_HUFFMAN_ONLY },
+	{ "rle", Z_RLE },
+	{ "fixed", Z_FIXED },
+};
+
+static struct RenderOptions {
+	uint8_t depth;
+	uint8_t filter;
+	int level;
+	int strategy;
+} renderOptions = {
+	.depth = 4,
+	.filter = PNGNone,
+	.level = Z_DEFAULT_COMPRESSION,
+	.strategy = Z_DEFAULT_STRATEGY,
+};
+
+static inline void renderFilterName(const char *name) {
+	for (uint8_t i = 0; i < ARRAY_LEN(RenderFilterNames); ++i) {
+		if (strcmp(name, RenderFilterNames[i])) continue;
+		renderOptions.filter = i;
+		return;
+	}
+	errx(EX_USAGE, "no filter %s", name);
+}
+
+static inline void renderStrategyName(const char *name) {
+	for (size_t i = 0; i < ARRAY_LEN(RenderStrategies); ++i) {
+		if (strcmp(name, RenderStrategies[i].name)) continue;
+		renderOptions.strategy = RenderStrategies[i].strategy;
+		return;
+	}
+	errx(EX_USAGE, "no strategy %s", name);
+}
+
+static inline uint32_t renderRowLen(uint32_t width) {
+	if (renderOptions.depth == 4) return 1 + (width + 1) / 2;
+	return 1 + width;
+}
+
+// Packs pixels to the bit depth. May be done in place.
+static inline void renderPack(
+	uint8_t *dst, const uint8_t *src, uint32_t width
+) {
+	if (renderOptions.depth != 4) {
+		memmove(dst, src, width);
+		return;
+	}
+	for (uint32_t x = 0; x < width / 2; ++x) {
+		dst[x] = src[2 * x] << 4 | src[2 * x + 1];
+	}
+	if (width % 2) dst[width / 2] = src[width - 1] << 4;
+}
+
+static inline uint8_t renderPaeth(uint8_t a, uint8_t b, uint8_t c) {
+	int p = a + b - c;
+	int pa = abs(p - a);
+	int pb = abs(p - b);
+	int pc = abs(p - c);
+	if (pa <= pb && pa <= pc) return a;
+	if (pb <= pc) return b;
+	return c;
+}
+
+static inline void renderFilterRow(
+	uint8_t *out, const uint8_t *row, const uint8_t *prev, uint32_t len,
+	uint8_t filter
+) {
+	out[0] = filter;
+	for (uint32_t i = 1; i < len; ++i) {
+		uint8_t a = (i > 1 ? row[i - 1] : 0);
+		uint8_t b = prev[i];
+		uint8_t c = (i > 1 ? prev[i - 1] : 0);
+		switch (filter) {
+			break; case PNGSub:     out[i] = row[i] - a;
+			break; case PNGUp:      out[i] = row[i] - b;
+			break; case PNGAverage: out[i] = row[i] - (a + b) / 2;
+			break; case PNGPaeth:   out[i] = row[i] - renderPaeth(a, b, c);
+			break; default:         out[i] = row[i];
+		}
+	}
+}
+
+static inline uint32_t renderCost(const uint8_t *row, uint32_t len) {
+	uint32_t cost = 0;
+	for (uint32_t i = 1; i < len; ++i) cost += abs((int8_t)row[i]);
+	return cost;
+}
+
+// Filters an unfiltered scanline given the one above it, or zeros, into out,
+// using scratch of the same length to choose an adaptive filter.
+static inline void renderFilter(
+	uint8_t *out, const uint8_t *row, const uint8_t *prev, uint32_t len,
+	uint8_t *scratch
+) {
+	if (renderOptions.filter != RenderAdaptive) {
+		renderFilterRow(out, row, prev, len, renderOptions.filter);
+		return;
+	}
+	uint32_t bestCost = UINT32_MAX;
+	for (uint8_t filter = PNGNone; filter <= PNGPaeth; ++filter) {
+		renderFilterRow(scratch, row, prev, len, filter);
+		uint32_t cost = renderCost(scratch, len);
+		if (cost >= bestCost) continue;
+		bestCost = cost;
+		memcpy(out, scratch, len);
+	}
+}
+
+// Packs and filters in place the scanlines written by renderRaster, returning
+// their new total length. Rows are filtered from the bottom up so that each
+// row above is still unfiltered.
+static inline size_t renderScanlines(uint8_t *ptr) {
+	uint32_t width = renderWidth();
+	uint32_t height = renderHeight();
+	uint32_t len = renderRowLen(width);
+	if (renderOptions.depth == 4) {
+		for (uint32_t y = 0; y < height; ++y) {
+			ptr[y * len] = PNGNone;
+			renderPack(&ptr[y * len + 1], &ptr[y * (1 + width) + 1], width);
+		}
+	}
+	if (renderOptions.filter == PNGNone) return (size_t)height * len;
+
+	uint8_t zero[len];
+	uint8_t out[len];
+	uint8_t scratch[len];
+	memset(zero, 0, len);
+	for (uint32_t y = height; y-- > 0;) {
+		uint8_t *row = &ptr[y * len];
+		const uint8_t *prev = (y ? &ptr[(y - 1) * len] : zero);
+		renderFilter(out, row, prev, len, scratch);
+		memcpy(row, out, len);
+	}
+	return (size_t)height * len;
+}
+
+static inline size_t renderDeflate(
+	uint8_t *dst, size_t cap, const uint8_t *src, size_t len
+) {
+	z_stream stream = {
+		.next_in = (uint8_t *)src,
+		.avail_in = len,
+		.next_out = dst,
+		.avail_out = cap,
+	};
+	int error = deflateInit2(
+		&stream, renderOptions.level, Z_DEFLATED, 15, 8,
+		renderOptions.strategy
+	);
+	if (error) errx(EX_SOFTWARE, "deflateInit2: %d", error);
+	error = deflate(&stream, Z_FINISH);
+	if (error != Z_STREAM_END) errx(EX_SOFTWARE, "deflate: %d", error);
+	deflateEnd(&stream);
+	return stream.total_out;
+}
+
+// Encodes the scanlines of a tile-sized image written as by renderRaster,
+// packing and filtering them in place.
+static inline void renderEncode(FILE *stream, uint8_t *ptr) {
+	pngHead(
+		stream, renderWidth(), renderHeight(), renderOptions.depth, PNGIndexed
+	);
+	pngPalette(stream, (uint8_t *)Palette, sizeof(Palette));
+
+	size_t len = renderScanlines(ptr);
+
+	size_t zlen = compressBound(len);
+	uint8_t zdata[zlen];
+	zlen = renderDeflate(zdata, zlen, ptr, len);
+
+	pngDeflated(stream, zdata, zlen);
+	pngTail(stream);
+}
+
+static inline void render(FILE *stream, const struct Tile *tile) {
+	uint8_t data[renderHeight()][1 + renderWidth()];
+	renderRaster((uint8_t *)data, tile);
+	renderEncode(stream, (uint8_t *)data);
+}
+
+// Deflate writes directly into the free end of the buffer.
+static inline void renderStream(struct PNGBuffer *buf, z_stream *z, int flush) {
+	int error;
+	do {
+		z->next_out = &buf->ptr[buf->len];
+		z->avail_out = PNGBufferCap - buf->len;
+		error = deflate(z, flush);
+		if (error != Z_OK && error != Z_STREAM_END && error != Z_BUF_ERROR) {
+			errx(EX_SOFTWARE, "deflate: %d", error);
+		}
+		buf->len = PNGBufferCap - z->avail_out;
+		if (buf->len == PNGBufferCap) pngBufferFlush(buf);
+	} while (z->avail_in || (flush == Z_FINISH && error != Z_STREAM_END));
+	if (flush == Z_FINISH) pngBufferFlush(buf);
+}
+
+// Renders cols by rows tiles from tileX and tileY, wrapping around the torus,
+// one scanline at a time into a streaming deflate, so memory is bounded by
+// the width of the region.
+static inline void renderRegion(
+	FILE *stream, const struct Tile *tiles, uint32_t tileX, uint32_t tileY,
+	uint32_t cols, uint32_t rows
+) {
+	uint32_t tileWidth = renderWidth();
+	uint32_t width = cols * tileWidth;
+	uint32_t height = rows * renderHeight();
+	uint32_t len = renderRowLen(width);
+
+	pngHead(stream, width, height, renderOptions.depth, PNGIndexed);
+	pngPalette(stream, (uint8_t *)Palette, sizeof(Palette));
+
+	uint8_t *pixels = malloc(width);
+	uint8_t *prev = calloc(len, 1);
+	uint8_t *row = malloc(len);
+	uint8_t *out = malloc(len);
+	uint8_t *scratch = malloc(len);
+	struct PNGBuffer *buf = malloc(sizeof(*buf));
+	if (!pixels || !prev || !row || !out || !scratch || !buf) {
+		err(EX_OSERR, "malloc");
+	}
+
+	buf->file = stream;
+	buf->len = 0;
+	z_stream z = {0};
+	int error = deflateInit2(
+		&z, renderOptions.level, Z_DEFLATED, 15, 8, renderOptions.strategy
+	);
+	if (error) errx(EX_SOFTWARE, "deflateInit2: %d", error);
+
+	for (uint32_t r = 0; r < rows; ++r) {
+		const struct Tile *tileRow = &tiles[(tileY + r) % TileRows * TileCols];
+		for (uint32_t cellY = 0; cellY < CellRows; ++cellY) {
+			for (uint32_t y = 0; y < font.glyph.height; ++y) {
+				for (uint32_t c = 0; c < cols; ++c) {
+					renderRow(
+						&pixels[c * tileWidth],
+						&tileRow[(tileX + c) % TileCols], cellY, y
+					);
+				}
+				row[0] = PNGNone;
+				renderPack(&row[1], pixels, width);
+				renderFilter(out, row, prev, len, scratch);
+
+				z.next_in = out;
+				z.avail_in = len;
+				renderStream(buf, &z, Z_NO_FLUSH);
+
+				uint8_t *swap = prev;
+				prev = row;
+				row = swap;
+			}
+		}
+	}
+	renderStream(buf, &z, Z_FINISH);
+	deflateEnd(&z);
+	pngTail(stream);
+
+	free(pixels);
+	free(prev);
+	free(row);
+	free(out);
+	free(scratch);
+	free(buf);
+}
+
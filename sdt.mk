@@ -0,0 +1,3 @@
+CFLAGS += -DHAVE_SDT
+SDT_HDRS = probes.h
+SDT_OBJS = probes.o
@@ -22,12 +22,16 @@
 #include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/event.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <sysexits.h>
 #include <time.h>
@@ -40,16 +44,45 @@
 
 #include "torus.h"
 
+// Static probes of the torus provider for dtrace(1). See torus.d.
+#ifdef HAVE_SDT
+#include "probes.h"
+#define TRACE(probe, ...) TORUS_##probe(__VA_ARGS__)
+#else
+#define TRACE(...)
+#endif
+
+static bool replica;
+static struct Tile blank;
 static struct Tile *tiles;
 
 static void tilesMap(const char *path) {
-	int fd = open(path, O_CREAT | O_RDWR, 0644);
-	if (fd < 0) err(EX_CANTCREAT, "%s", path);
+	int error;
+	int fd;
+	if (replica) {
+		fd = open(path, O_RDONLY);
+		if (fd < 0) err(EX_NOINPUT, "%s", path);
 
-	int error = ftruncate(fd, TilesSize);
-	if (error) err(EX_IOERR, "%s", path);
+		struct stat stat;
+		error = fstat(fd, &stat);
+		if (error) err(EX_IOERR, "%s", path);
 
-	tiles = mmap(NULL, TilesSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if ((size_t)stat.st_size < TilesSize) {
+			errx(EX_DATAERR, "%s: truncated tiles", path);
+		}
+
+		memset(blank.cells, ' ', CellsSize);
+		memset(blank.colors, ColorWhite, CellsSize);
+	} else {
+		fd = open(path, O_CREAT | O_RDWR, 0644);
+		if (fd < 0) err(EX_CANTCREAT, "%s", path);
+
+		error = ftruncate(fd, TilesSize);
+		if (error) err(EX_IOERR, "%s", path);
+	}
+
+	int prot = (replica ? PROT_READ : PROT_READ | PROT_WRITE);
+	tiles = mmap(NULL, TilesSize, prot, MAP_SHARED, fd, 0);
 	if (tiles == MAP_FAILED) err(EX_OSERR, "mmap");
 	close(fd);
 
@@ -62,20 +95,197 @@ static void tilesMap(const char *path) {
 #endif
 }
 
+// Tile metadata is kept in memory as a pyramid of grids, each level
+// summarizing 2x2 cells of the level below, so that maps never touch tile
+// pages. Cells hold the earliest creation, latest times and total counts.
+enum { MetaLevels = 10 };
+static_assert(TileCols == 1 << (MetaLevels - 1), "pyramid covers tiles");
+static_assert(TileRows == TileCols, "pyramid is square");
+
+static struct Meta *metaLevels[MetaLevels];
+static int metaFd = -1;
+
+static struct Meta *metaCell(int level, uint32_t tileX, uint32_t tileY) {
+	uint32_t cols = TileCols >> level;
+	return &metaLevels[level][(tileY >> level) * cols + (tileX >> level)];
+}
+
+static uint32_t saturate(uint32_t a, uint32_t b) {
+	return (a + b < a ? UINT32_MAX : a + b);
+}
+
+static void metaMerge(struct Meta *meta, struct Meta add) {
+	if (add.createTime) {
+		if (!meta->createTime || add.createTime < meta->createTime) {
+			meta->createTime = add.createTime;
+		}
+	}
+	if (add.modifyTime > meta->modifyTime) meta->modifyTime = add.modifyTime;
+	if (add.accessTime > meta->accessTime) meta->accessTime = add.accessTime;
+	meta->modifyCount = saturate(meta->modifyCount, add.modifyCount);
+	meta->accessCount = saturate(meta->accessCount, add.accessCount);
+}
+
+static void metaAdd(uint32_t tileX, uint32_t tileY, struct Meta add) {
+	for (int level = 0; level < MetaLevels; ++level) {
+		metaMerge(metaCell(level, tileX, tileY), add);
+	}
+}
+
+// The pyramid is kept in shared memory, which is handed off on upgrade, so
+// that only a cold start reads every tile.
+static size_t metaSize(void) {
+	size_t len = 0;
+	for (int level = 0; level < MetaLevels; ++level) {
+		len += (size_t)(TileRows >> level) * (TileCols >> level);
+	}
+	return len * sizeof(struct Meta);
+}
+
+static void metaMap(int fd) {
+	struct stat stat;
+	int error = fstat(fd, &stat);
+	if (error) err(EX_IOERR, "fstat");
+	if ((size_t)stat.st_size != metaSize()) {
+		errx(EX_PROTOCOL, "invalid handoff metadata");
+	}
+
+	struct Meta *meta = mmap(
+		NULL, metaSize(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0
+	);
+	if (meta == MAP_FAILED) err(EX_OSERR, "mmap");
+	for (int level = 0; level < MetaLevels; ++level) {
+		metaLevels[level] = meta;
+		meta += (size_t)(TileRows >> level) * (TileCols >> level);
+	}
+	metaFd = fd;
+}
+
+// A replica subscribes before scanning and holds the changes it follows until
+// the scan is done, so that the feed does not fall behind while it scans.
+static uint8_t followBuf[64 * sizeof(struct Change)];
+static size_t followLen;
+static struct Change *followHeld;
+static size_t followHeldLen;
+static size_t followHeldCap;
+
+static bool followHold(int follow) {
+	for (;;) {
+		ssize_t size = recv(
+			follow, &followBuf[followLen], sizeof(followBuf) - followLen,
+			MSG_DONTWAIT
+		);
+		if (size < 0 && errno == EAGAIN) return true;
+		if (size <= 0) return false;
+		followLen += size;
+
+		size_t count = followLen / sizeof(struct Change);
+		if (followHeldLen + count > followHeldCap) {
+			followHeldCap = (followHeldCap ? followHeldCap * 2 : 4096);
+			followHeld = realloc(
+				followHeld, sizeof(*followHeld) * followHeldCap
+			);
+			if (!followHeld) err(EX_OSERR, "realloc");
+		}
+		memcpy(
+			&followHeld[followHeldLen], followBuf,
+			count * sizeof(struct Change)
+		);
+		followHeldLen += count;
+
+		followLen -= count * sizeof(struct Change);
+		memmove(
+			followBuf, &followBuf[count * sizeof(struct Change)], followLen
+		);
+	}
+}
+
+static bool metaBuild(int follow) {
+#ifdef SHM_ANON
+	int fd = shm_open(SHM_ANON, O_RDWR, 0600);
+	if (fd < 0) err(EX_OSERR, "shm_open");
+#else
+	char name[32];
+	snprintf(name, sizeof(name), "/torus.%d", (int)getpid());
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) err(EX_OSERR, "shm_open");
+	shm_unlink(name);
+#endif
+	int error = ftruncate(fd, metaSize());
+	if (error) err(EX_OSERR, "ftruncate");
+	metaMap(fd);
+
+	error = madvise(tiles, TilesSize, MADV_SEQUENTIAL);
+	if (error) err(EX_OSERR, "madvise");
+	for (uint32_t tileY = 0; tileY < TileRows; ++tileY) {
+		if (follow >= 0 && !followHold(follow)) return false;
+		for (uint32_t tileX = 0; tileX < TileCols; ++tileX) {
+			struct Meta meta = tileMeta(&tiles[tileY * TileRows + tileX]);
+			metaAdd(tileX, tileY, meta);
+		}
+	}
+	error = madvise(tiles, TilesSize, MADV_RANDOM);
+	if (error) err(EX_OSERR, "madvise");
+	return true;
+}
+
+// Thumbnails are computed when first requested and then kept up to date by
+// each put. Tiles not yet created are blank without being faulted in.
+static struct Thumb thumbs[TileRows][TileCols];
+static bool thumbsValid[TileRows][TileCols];
+
+static const struct Thumb *thumbGet(uint32_t tileX, uint32_t tileY) {
+	static const struct Thumb Blank;
+	if (thumbsValid[tileY][tileX]) return &thumbs[tileY][tileX];
+	if (!metaCell(0, tileX, tileY)->createTime) return &Blank;
+
+	const struct Tile *tile = &tiles[tileY * TileRows + tileX];
+	struct Thumb *thumb = &thumbs[tileY][tileX];
+	for (int y = 0; y < ThumbRows; ++y) {
+		for (int x = 0; x < ThumbCols; ++x) {
+			thumb->colors[y][x] = thumbBlock(tile, y, x);
+		}
+	}
+	thumbsValid[tileY][tileX] = true;
+	return thumb;
+}
+
+static void thumbUpdate(
+	uint32_t tileX, uint32_t tileY, uint8_t cellX, uint8_t cellY
+) {
+	if (!thumbsValid[tileY][tileX]) return;
+	int y = cellY / ThumbBlockRows;
+	int x = cellX / ThumbBlockCols;
+	thumbs[tileY][tileX].colors[y][x] = thumbBlock(
+		&tiles[tileY * TileRows + tileX], y, x
+	);
+}
+
 static struct Tile *tileGet(uint32_t tileX, uint32_t tileY) {
+	TRACE(TILE_START, tileX, tileY);
 	struct Tile *tile = &tiles[tileY * TileRows + tileX];
 	if (!tile->createTime) {
-		memset(tile->cells, ' ', CellsSize);
-		memset(tile->colors, ColorWhite, CellsSize);
-		tile->createTime = time(NULL);
+		if (replica) {
+			tile = &blank;
+		} else {
+			memset(tile->cells, ' ', CellsSize);
+			memset(tile->colors, ColorWhite, CellsSize);
+			tile->createTime = time(NULL);
+			struct Meta add = { .createTime = tile->createTime };
+			metaAdd(tileX, tileY, add);
+		}
 	}
+	TRACE(TILE_DONE, tileX, tileY);
 	return tile;
 }
 
 static struct Tile *tileAccess(uint32_t tileX, uint32_t tileY) {
 	struct Tile *tile = tileGet(tileX, tileY);
+	if (replica) return tile;
 	tile->accessTime = time(NULL);
 	tile->accessCount++;
+	struct Meta add = { .accessTime = tile->accessTime, .accessCount = 1 };
+	metaAdd(tileX, tileY, add);
 	return tile;
 }
 
@@ -83,69 +293,429 @@ static struct Tile *tileModify(uint32_t tileX, uint32_t tileY) {
 	struct Tile *tile = tileGet(tileX, tileY);
 	tile->modifyTime = time(NULL);
 	tile->modifyCount++;
+	struct Meta add = { .modifyTime = tile->modifyTime, .modifyCount = 1 };
+	metaAdd(tileX, tileY, add);
 	return tile;
 }
 
-static struct Client {
+enum { ChangesLen = 4096 };
+static struct Change changes[ChangesLen];
+static uint64_t changeTail = 1;
+static uint64_t changeSeq = 1;
+
+static struct Subscriber {
 	int fd;
 
+	bool ready;
+	uint64_t seq;
+	size_t off;
+
+	struct Subscriber *prev;
+	struct Subscriber *next;
+} *subscriberHead;
+
+static struct Subscriber *subscriberAdd(int fd) {
+	struct Subscriber *sub = malloc(sizeof(*sub));
+	if (!sub) err(EX_OSERR, "malloc");
+
+	sub->fd = fd;
+	sub->ready = false;
+	sub->seq = 0;
+	sub->off = 0;
+
+	sub->prev = NULL;
+	if (subscriberHead) {
+		subscriberHead->prev = sub;
+		sub->next = subscriberHead;
+	} else {
+		sub->next = NULL;
+	}
+	subscriberHead = sub;
+
+	return sub;
+}
+
+static struct Subscriber *subscriberFind(int fd) {
+	for (struct Subscriber *sub = subscriberHead; sub; sub = sub->next) {
+		if (sub->fd == fd) return sub;
+	}
+	return NULL;
+}
+
+static void subscriberRemove(struct Subscriber *sub) {
+	if (sub->prev) sub->prev->next = sub->next;
+	if (sub->next) sub->next->prev = sub->prev;
+	if (subscriberHead == sub) subscriberHead = sub->next;
+	close(sub->fd);
+	free(sub);
+}
+
+static bool subscriberFlush(struct Subscriber *sub) {
+	if (!sub->ready) return true;
+	if (sub->seq < changeTail || sub->seq > changeSeq) return false;
+	while (sub->seq < changeSeq) {
+		size_t index = sub->seq % ChangesLen;
+		size_t count = changeSeq - sub->seq;
+		if (count > ChangesLen - index) count = ChangesLen - index;
+
+		const uint8_t *ptr = (const uint8_t *)&changes[index] + sub->off;
+		size_t len = count * sizeof(struct Change) - sub->off;
+		ssize_t size = send(sub->fd, ptr, len, 0);
+		if (size < 0) return (errno == EAGAIN);
+
+		sub->off += size;
+		sub->seq += sub->off / sizeof(struct Change);
+		sub->off %= sizeof(struct Change);
+	}
+	return true;
+}
+
+static void feedPublish(struct Change change) {
+	if (changeSeq - changeTail == ChangesLen) changeTail++;
+	change.seq = changeSeq++;
+	changes[change.seq % ChangesLen] = change;
+
+	struct Subscriber *next;
+	for (struct Subscriber *sub = subscriberHead; sub; sub = next) {
+		next = sub->next;
+		if (!subscriberFlush(sub)) subscriberRemove(sub);
+	}
+}
+
+// Timers are kept in a hierarchical wheel of intrusive lists with one second
+// ticks, so arming and cancelling are constant time. Each level's slots span
+// the whole of the level below it.
+enum {
+	WheelBits = 6,
+	WheelSlots = 1 << WheelBits,
+	WheelLevels = 4,
+	WheelMax = (1 << (WheelBits * WheelLevels)) - 1,
+};
+
+struct Timer {
+	uint64_t expire;
+	void (*fire)(struct Timer *);
+	struct Timer *prev;
+	struct Timer *next;
+};
+
+static struct Timer wheel[WheelLevels][WheelSlots];
+static uint64_t wheelTick;
+
+static uint64_t wheelNow(void) {
+	struct timespec now;
+	int error = clock_gettime(CLOCK_MONOTONIC, &now);
+	if (error) err(EX_OSERR, "clock_gettime");
+	return now.tv_sec;
+}
+
+static void wheelInit(void) {
+	for (int l = 0; l < WheelLevels; ++l) {
+		for (int i = 0; i < WheelSlots; ++i) {
+			wheel[l][i].prev = &wheel[l][i];
+			wheel[l][i].next = &wheel[l][i];
+		}
+	}
+	wheelTick = wheelNow();
+}
+
+static void wheelInsert(struct Timer *timer) {
+	uint64_t delta = timer->expire - wheelTick;
+	int l = 0;
+	while (l < WheelLevels - 1 && delta >> (WheelBits * (l + 1))) l++;
+	struct Timer *head = &wheel[l][
+		(timer->expire >> (WheelBits * l)) & (WheelSlots - 1)
+	];
+	timer->prev = head->prev;
+	timer->next = head;
+	head->prev->next = timer;
+	head->prev = timer;
+}
+
+static void timerCancel(struct Timer *timer) {
+	if (!timer->next) return;
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->prev = NULL;
+	timer->next = NULL;
+}
+
+static void timerArm(struct Timer *timer, uint64_t ticks) {
+	timerCancel(timer);
+	if (ticks < 1) ticks = 1;
+	if (ticks > WheelMax) ticks = WheelMax;
+	timer->expire = wheelTick + ticks;
+	wheelInsert(timer);
+}
+
+static void wheelAdvance(uint64_t now) {
+	while (wheelTick < now) {
+		wheelTick++;
+
+		// Timers on higher levels are redistributed as their slot comes due.
+		for (int l = 1; l < WheelLevels; ++l) {
+			if (wheelTick & ((UINT64_C(1) << (WheelBits * l)) - 1)) break;
+			struct Timer *head = &wheel[l][
+				(wheelTick >> (WheelBits * l)) & (WheelSlots - 1)
+			];
+			while (head->next != head) {
+				struct Timer *timer = head->next;
+				timerCancel(timer);
+				wheelInsert(timer);
+			}
+		}
+
+		struct Timer *head = &wheel[0][wheelTick & (WheelSlots - 1)];
+		while (head->next != head) {
+			struct Timer *timer = head->next;
+			timerCancel(timer);
+			timer->fire(timer);
+		}
+	}
+}
+
+// Histograms have four linear buckets per power of two, so recording is a few
+// instructions and values keep two bits of precision.
+enum {
+	HistSub = 2,
+	HistLen = 40 << HistSub,
+};
+
+struct Hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t buckets[HistLen];
+};
+
+static size_t histBucket(uint64_t value) {
+	if (value < (1 << HistSub)) return value;
+	int exp = 63 - __builtin_clzll(value);
+	size_t bucket = (size_t)(exp - HistSub + 1) << HistSub
+		| (value >> (exp - HistSub) & ((1 << HistSub) - 1));
+	return (bucket < HistLen ? bucket : HistLen - 1);
+}
+
+static uint64_t histFloor(size_t bucket) {
+	if (bucket < (1 << HistSub)) return bucket;
+	int exp = (bucket >> HistSub) + HistSub - 1;
+	uint64_t mantissa = (1 << HistSub) | (bucket & ((1 << HistSub) - 1));
+	return mantissa << (exp - HistSub);
+}
+
+static void histAdd(struct Hist *hist, uint64_t value) {
+	hist->count++;
+	hist->sum += value;
+	hist->buckets[histBucket(value)]++;
+}
+
+enum Disconnect {
+	DisconnectClosed,
+	DisconnectRead,
+	DisconnectPartial,
+	DisconnectDispatch,
+	DisconnectSend,
+	DisconnectProbe,
+	DisconnectFull,
+	DisconnectsLen,
+};
+
+static const char *DisconnectNames[DisconnectsLen] = {
+	[DisconnectClosed] = "closed",
+	[DisconnectRead] = "read",
+	[DisconnectPartial] = "partial",
+	[DisconnectDispatch] = "dispatch",
+	[DisconnectSend] = "send",
+	[DisconnectProbe] = "probe",
+	[DisconnectFull] = "full",
+};
+
+static const char *MessageNames[] = {
+	[ClientMove] = "move",
+	[ClientFlip] = "flip",
+	[ClientPut] = "put",
+	[ClientMap] = "map",
+	[ClientTele] = "tele",
+	[ClientThumb] = "thumb",
+};
+
+static struct {
+	struct Hist dispatch[ARRAY_LEN(MessageNames)];
+	struct Hist cast;
+	uint64_t sentBytes;
+	uint64_t sentTiles;
+	uint64_t sendFailures;
+	uint64_t disconnects[DisconnectsLen];
+} stats;
+
+static uint64_t statsNow(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Clients are packed densely so that casts scan contiguous memory, and are
+// found by descriptor through a table of one-based indices.
+static struct Client {
+	int fd;
 	uint32_t tileX;
 	uint32_t tileY;
 	uint8_t cellX;
 	uint8_t cellY;
+	bool drop;
+} *clients;
+static size_t clientsLen;
+static size_t clientsCap;
+
+static uint32_t *clientIndex;
+static size_t clientIndexLen;
+
+// Descriptors are reused, so each connection is given a serial, which its
+// events carry to tell them apart from those of an earlier connection.
+static uint32_t *clientSerials;
+static uint32_t clientSerial;
+
+// Clients whose sends fail during a cast are removed afterwards, since
+// removal reorders the clients being cast to.
+static int *clientDrops;
+static size_t clientDropsLen;
+
+// Idle state is rarely touched, so it is kept apart and indexed by descriptor.
+static struct Idle {
+	struct Timer timer;
+	uint64_t active;
+} *clientIdle;
+static uint64_t idleTimeout;
+
+static void clientsAlloc(size_t cap) {
+	clientsCap = cap;
+	clients = calloc(cap, sizeof(*clients));
+	if (!clients) err(EX_OSERR, "calloc");
+
+	clientIndexLen = getdtablesize();
+	clientIndex = calloc(clientIndexLen, sizeof(*clientIndex));
+	if (!clientIndex) err(EX_OSERR, "calloc");
+
+	clientSerials = calloc(clientIndexLen, sizeof(*clientSerials));
+	if (!clientSerials) err(EX_OSERR, "calloc");
+
+	clientDrops = calloc(cap, sizeof(*clientDrops));
+	if (!clientDrops) err(EX_OSERR, "calloc");
+
+	clientIdle = calloc(clientIndexLen, sizeof(*clientIdle));
+	if (!clientIdle) err(EX_OSERR, "calloc");
+}
+
+static struct Client *clientFind(int fd) {
+	if (fd < 0 || (size_t)fd >= clientIndexLen) return NULL;
+	uint32_t index = clientIndex[fd];
+	return (index ? &clients[index - 1] : NULL);
+}
+
+// Inbound traffic is recorded for replay by load, with connections
+// identified by serial.
+static FILE *trace;
+static uint64_t traceStart;
 
-	struct Client *prev;
-	struct Client *next;
-} *clientHead;
+static void traceOpen(const char *path) {
+	trace = fopen(path, "w");
+	if (!trace) err(EX_CANTCREAT, "%s", path);
+	traceStart = statsNow();
+}
+
+static void traceFail(void) {
+	warn("trace");
+	fclose(trace);
+	trace = NULL;
+}
+
+static void traceRecord(int fd, struct Trace record) {
+	if (!trace) return;
+	record.time = statsNow() - traceStart;
+	record.conn = clientSerials[fd];
+	if (!fwrite(&record, sizeof(record), 1, trace)) traceFail();
+}
+
+static void clientIdleFire(struct Timer *timer);
 
 static struct Client *clientAdd(int fd) {
-	struct Client *client = malloc(sizeof(*client));
-	if (!client) err(EX_OSERR, "malloc");
+	if (clientsLen == clientsCap) return NULL;
+	if (fd < 0 || (size_t)fd >= clientIndexLen) return NULL;
+
+	struct Client *client = &clients[clientsLen++];
+	clientIndex[fd] = clientsLen;
 
 	client->fd = fd;
 	client->tileX = TileInitX;
 	client->tileY = TileInitY;
 	client->cellX = CellInitX;
 	client->cellY = CellInitY;
+	client->drop = false;
+	clientSerials[fd] = ++clientSerial;
 
-	client->prev = NULL;
-	if (clientHead) {
-		clientHead->prev = client;
-		client->next = clientHead;
-	} else {
-		client->next = NULL;
+	traceRecord(fd, (struct Trace) { .type = TraceConnect });
+
+	if (idleTimeout) {
+		struct Idle *idle = &clientIdle[fd];
+		idle->active = wheelTick;
+		idle->timer.fire = clientIdleFire;
+		timerArm(&idle->timer, idleTimeout);
 	}
-	clientHead = client;
 
 	return client;
 }
 
-static bool clientSend(const struct Client *client, struct ServerMessage msg) {
-	ssize_t size = send(client->fd, &msg, sizeof(msg), 0);
-	if (size < 0) return false;
+// Messages and their payloads are written in one call, and tiles are written
+// directly from the mapping.
+static bool clientWrite(
+	const struct Client *client, struct ServerMessage msg,
+	const void *ptr, size_t len
+) {
+	struct iovec iov[2] = {
+		{ .iov_base = &msg, .iov_len = sizeof(msg) },
+		{ .iov_base = (void *)ptr, .iov_len = len },
+	};
+	TRACE(SEND_START, client->fd, msg.type, sizeof(msg) + len);
+	ssize_t size = writev(client->fd, iov, (len ? 2 : 1));
+	TRACE(SEND_DONE, client->fd, size);
+	if (size > 0) stats.sentBytes += size;
+	if (size == (ssize_t)(sizeof(msg) + len)) return true;
+	stats.sendFailures++;
+	return false;
+}
 
+static bool clientSend(const struct Client *client, struct ServerMessage msg) {
 	if (msg.type == ServerTile) {
 		struct Tile *tile = tileAccess(client->tileX, client->tileY);
-		size = send(client->fd, tile, sizeof(*tile), 0);
-		if (size < 0) return false;
+		stats.sentTiles++;
+		return clientWrite(client, msg, tile, sizeof(*tile));
 	}
+	return clientWrite(client, msg, NULL, 0);
+}
 
-	return true;
+static void clientDrop(struct Client *client) {
+	if (client->drop) return;
+	client->drop = true;
+	clientDrops[clientDropsLen++] = client->fd;
 }
 
 static void clientCast(const struct Client *origin, struct ServerMessage msg) {
-	for (struct Client *client = clientHead; client; client = client->next) {
+	TRACE(CAST_START, origin->fd, msg.type, origin->tileX, origin->tileY);
+	uint64_t count = 0;
+	for (size_t i = 0; i < clientsLen; ++i) {
+		struct Client *client = &clients[i];
 		if (client == origin) continue;
 		if (client->tileX != origin->tileX) continue;
 		if (client->tileY != origin->tileY) continue;
-		clientSend(client, msg);
+		if (client->drop) continue;
+		if (!clientSend(client, msg)) clientDrop(client);
+		count++;
 	}
+	TRACE(CAST_DONE, origin->fd, count);
+	histAdd(&stats.cast, count);
 }
 
-static void clientRemove(struct Client *client) {
-	if (client->prev) client->prev->next = client->next;
-	if (client->next) client->next->prev = client->prev;
-	if (clientHead == client) clientHead = client->next;
+static void clientRemove(struct Client *client, enum Disconnect reason) {
+	stats.disconnects[reason]++;
 
 	struct ServerMessage msg = {
 		.type = ServerCursor,
@@ -156,8 +726,49 @@ static void clientRemove(struct Client *client) {
 	};
 	clientCast(client, msg);
 
+	traceRecord(client->fd, (struct Trace) { .type = TraceDisconnect });
+	timerCancel(&clientIdle[client->fd].timer);
 	close(client->fd);
-	free(client);
+	clientIndex[client->fd] = 0;
+
+	struct Client *last = &clients[--clientsLen];
+	if (client != last) {
+		*client = *last;
+		clientIndex[client->fd] = client - clients + 1;
+	}
+}
+
+static void clientsReap(void) {
+	while (clientDropsLen) {
+		struct Client *client = clientFind(clientDrops[--clientDropsLen]);
+		if (client && client->drop) clientRemove(client, DisconnectSend);
+	}
+}
+
+// Clients which send nothing for the timeout are probed with their own
+// position, and removed only if the probe cannot be written, so that clients
+// which only watch are kept while those which stopped reading are not.
+static void clientIdleFire(struct Timer *timer) {
+	struct Idle *idle = (struct Idle *)timer;
+	struct Client *client = clientFind(idle - clientIdle);
+	if (!client) return;
+
+	uint64_t elapsed = wheelTick - idle->active;
+	if (elapsed < idleTimeout) {
+		timerArm(timer, idleTimeout - elapsed);
+		return;
+	}
+
+	struct ServerMessage msg = {
+		.type = ServerMove,
+		.move = { .cellX = client->cellX, .cellY = client->cellY },
+	};
+	if (!clientSend(client, msg)) {
+		clientRemove(client, DisconnectProbe);
+		return;
+	}
+	idle->active = wheelTick;
+	timerArm(timer, idleTimeout);
 }
 
 static bool clientCursors(const struct Client *client) {
@@ -166,7 +777,8 @@ static bool clientCursors(const struct Client *client) {
 		.cursor = { .oldCellX = CursorNone, .oldCellY = CursorNone },
 	};
 
-	for (struct Client *friend = clientHead; friend; friend = friend->next) {
+	for (size_t i = 0; i < clientsLen; ++i) {
+		const struct Client *friend = &clients[i];
 		if (friend == client) continue;
 		if (friend->tileX != client->tileX) continue;
 		if (friend->tileY != client->tileY) continue;
@@ -272,9 +884,22 @@ static bool clientFlip(struct Client *client) {
 }
 
 static bool clientPut(const struct Client *client, uint8_t color, uint8_t cell) {
+	if (replica) return true;
+
 	struct Tile *tile = tileModify(client->tileX, client->tileY);
 	tile->colors[client->cellY][client->cellX] = color;
 	tile->cells[client->cellY][client->cellX] = cell;
+	thumbUpdate(client->tileX, client->tileY, client->cellX, client->cellY);
+
+	feedPublish((struct Change) {
+		.time = tile->modifyTime,
+		.tileX = client->tileX,
+		.tileY = client->tileY,
+		.cellX = client->cellX,
+		.cellY = client->cellY,
+		.color = color,
+		.cell = cell,
+	});
 
 	struct ServerMessage msg = {
 		.type = ServerPut,
@@ -290,73 +915,47 @@ static bool clientPut(const struct Client *client, uint8_t color, uint8_t cell)
 	return success;
 }
 
-static bool clientMap(const struct Client *client) {
-	int32_t mapY = (int32_t)client->tileY - MapRows / 2;
-	int32_t mapX = (int32_t)client->tileX - MapCols / 2;
-
-	time_t now = time(NULL);
-	struct Map map = {
-		.now = now,
-		.min = {
-			.createTime = now,
-			.modifyTime = now,
-			.accessTime = now,
-			.modifyCount = UINT32_MAX,
-			.accessCount = UINT32_MAX,
-		},
-	};
-
+// Maps are centered dx and dy cells from the client's tile, each cell
+// summarizing the block of tiles at that level of the pyramid.
+static bool clientMap(
+	const struct Client *client, uint8_t zoom, int8_t dx, int8_t dy
+) {
+	if (zoom > MapZoomMax) return false;
+	int32_t rows = TileRows >> zoom;
+	int32_t cols = TileCols >> zoom;
+	int32_t mapY = (int32_t)(client->tileY >> zoom) + dy - MapRows / 2;
+	int32_t mapX = (int32_t)(client->tileX >> zoom) + dx - MapCols / 2;
+
+	struct Map map;
+	mapInit(&map, time(NULL));
 	for (int32_t y = 0; y < MapRows; ++y) {
 		for (int32_t x = 0; x < MapCols; ++x) {
-			uint32_t tileY = ((mapY + y) % TileRows + TileRows) % TileRows;
-			uint32_t tileX = ((mapX + x) % TileCols + TileCols) % TileCols;
-			struct Meta meta = tileMeta(&tiles[tileY * TileRows + tileX]);
+			uint32_t blockY = ((mapY + y) % rows + rows) % rows;
+			uint32_t blockX = ((mapX + x) % cols + cols) % cols;
+			struct Meta *meta = metaCell(zoom, blockX << zoom, blockY << zoom);
+			mapSet(&map, y, x, *meta);
+		}
+	}
 
-			if (meta.createTime > 1) {
-				if (meta.createTime < map.min.createTime) {
-					map.min.createTime = meta.createTime;
-				}
-				if (meta.createTime > map.max.createTime) {
-					map.max.createTime = meta.createTime;
-				}
-			}
-			if (meta.modifyTime) {
-				if (meta.modifyTime < map.min.modifyTime) {
-					map.min.modifyTime = meta.modifyTime;
-				}
-				if (meta.modifyTime > map.max.modifyTime) {
-					map.max.modifyTime = meta.modifyTime;
-				}
-			}
-			if (meta.accessTime) {
-				if (meta.accessTime < map.min.accessTime) {
-					map.min.accessTime = meta.accessTime;
-				}
-				if (meta.accessTime > map.max.accessTime) {
-					map.max.accessTime = meta.accessTime;
-				}
-			}
-			if (meta.modifyCount < map.min.modifyCount) {
-				map.min.modifyCount = meta.modifyCount;
-			}
-			if (meta.modifyCount > map.max.modifyCount) {
-				map.max.modifyCount = meta.modifyCount;
-			}
-			if (meta.accessCount < map.min.accessCount) {
-				map.min.accessCount = meta.accessCount;
-			}
-			if (meta.accessCount > map.max.accessCount) {
-				map.max.accessCount = meta.accessCount;
-			}
+	struct ServerMessage msg = { .type = ServerMap };
+	return clientWrite(client, msg, &map, sizeof(map));
+}
+
+static bool clientThumb(const struct Client *client) {
+	int32_t minimapY = (int32_t)client->tileY - MinimapRows / 2;
+	int32_t minimapX = (int32_t)client->tileX - MinimapCols / 2;
 
-			map.meta[y][x] = meta;
+	struct Minimap minimap;
+	for (int32_t y = 0; y < MinimapRows; ++y) {
+		for (int32_t x = 0; x < MinimapCols; ++x) {
+			uint32_t tileY = ((minimapY + y) % TileRows + TileRows) % TileRows;
+			uint32_t tileX = ((minimapX + x) % TileCols + TileCols) % TileCols;
+			minimap.thumbs[y][x] = *thumbGet(tileX, tileY);
 		}
 	}
 
-	struct ServerMessage msg = { .type = ServerMap };
-	if (!clientSend(client, msg)) return false;
-	if (0 > send(client->fd, &map, sizeof(map), 0)) return false;
-	return true;
+	struct ServerMessage msg = { .type = ServerThumb };
+	return clientWrite(client, msg, &minimap, sizeof(minimap));
 }
 
 static bool clientTele(struct Client *client, uint8_t port) {
@@ -369,56 +968,644 @@ static bool clientTele(struct Client *client, uint8_t port) {
 	return clientUpdate(client, &old);
 }
 
+// The primary counts a change in the tile before publishing it, so the scan
+// may already count a followed change. Only the difference between the tile
+// and the pyramid is added, which also makes following a change twice safe.
+static void followMeta(uint32_t tileX, uint32_t tileY) {
+	const struct Tile *tile = &tiles[tileY * TileRows + tileX];
+	const struct Meta *meta = metaCell(0, tileX, tileY);
+	if (tile->modifyCount <= meta->modifyCount) return;
+	struct Meta add = {
+		.createTime = tile->createTime,
+		.modifyTime = tile->modifyTime,
+		.modifyCount = tile->modifyCount - meta->modifyCount,
+	};
+	metaAdd(tileX, tileY, add);
+}
+
+static bool followChange(struct Change change) {
+	if (change.tileX >= TileCols || change.tileY >= TileRows) return false;
+	if (change.cellX >= CellCols || change.cellY >= CellRows) return false;
+
+	struct ServerMessage msg = {
+		.type = ServerPut,
+		.put = {
+			.cellX = change.cellX,
+			.cellY = change.cellY,
+			.color = change.color,
+			.cell = change.cell,
+		},
+	};
+	for (size_t i = 0; i < clientsLen; ++i) {
+		struct Client *client = &clients[i];
+		if (client->tileX != change.tileX) continue;
+		if (client->tileY != change.tileY) continue;
+		if (client->drop) continue;
+		if (!clientSend(client, msg)) clientDrop(client);
+	}
+	followMeta(change.tileX, change.tileY);
+	thumbUpdate(change.tileX, change.tileY, change.cellX, change.cellY);
+	feedPublish(change);
+	return true;
+}
+
+static bool followRelease(void) {
+	for (size_t i = 0; i < followHeldLen; ++i) {
+		if (!followChange(followHeld[i])) return false;
+	}
+	free(followHeld);
+	followHeld = NULL;
+	followHeldLen = 0;
+	followHeldCap = 0;
+	return true;
+}
+
+static bool feedFollow(int feed) {
+	ssize_t size = recv(
+		feed, &followBuf[followLen], sizeof(followBuf) - followLen, 0
+	);
+	if (size <= 0) return false;
+	followLen += size;
+
+	size_t count = followLen / sizeof(struct Change);
+	for (size_t i = 0; i < count; ++i) {
+		struct Change change;
+		memcpy(&change, &followBuf[i * sizeof(change)], sizeof(change));
+		if (!followChange(change)) return false;
+	}
+
+	followLen -= count * sizeof(struct Change);
+	memmove(followBuf, &followBuf[count * sizeof(struct Change)], followLen);
+	return true;
+}
+
+static bool clientDispatch(struct Client *client, struct ClientMessage msg) {
+	struct Trace record = { .type = TraceMessage, .msg = msg };
+	traceRecord(client->fd, record);
+	bool success;
+	TRACE(DISPATCH_START, client->fd, msg.type, client->tileX, client->tileY);
+	uint64_t start = statsNow();
+	switch (msg.type) {
+		break; case ClientMove: {
+			success = clientMove(client, msg.move.dx, msg.move.dy);
+		}
+		break; case ClientFlip:  success = clientFlip(client);
+		break; case ClientPut: {
+			success = clientPut(client, msg.put.color, msg.put.cell);
+		}
+		break; case ClientMap: {
+			success = clientMap(client, msg.map.zoom, msg.map.dx, msg.map.dy);
+		}
+		break; case ClientTele:  success = clientTele(client, msg.port);
+		break; case ClientThumb: success = clientThumb(client);
+		break; default:          return false;
+	}
+	histAdd(&stats.dispatch[msg.type], statsNow() - start);
+	TRACE(DISPATCH_DONE, client->fd, msg.type, success);
+	return success;
+}
+
+static int tileCompare(const void *_a, const void *_b) {
+	const uint32_t *a = _a, *b = _b;
+	return (*a > *b) - (*a < *b);
+}
+
+static void histPrint(
+	FILE *file, const char *name, const char *label, const struct Hist *hist
+) {
+	uint64_t count = 0;
+	for (size_t i = 0; i < HistLen - 1; ++i) {
+		if (!hist->buckets[i]) continue;
+		count += hist->buckets[i];
+		fprintf(
+			file, "%s_bucket{%s%sle=\"%ju\"} %ju\n",
+			name, label, (label[0] ? "," : ""),
+			(uintmax_t)histFloor(i + 1) - 1, (uintmax_t)count
+		);
+	}
+	fprintf(
+		file, "%s_bucket{%s%sle=\"+Inf\"} %ju\n",
+		name, label, (label[0] ? "," : ""), (uintmax_t)hist->count
+	);
+	const char *open = (label[0] ? "{" : "");
+	const char *close = (label[0] ? "}" : "");
+	fprintf(
+		file, "%s_sum%s%s%s %ju\n",
+		name, open, label, close, (uintmax_t)hist->sum
+	);
+	fprintf(
+		file, "%s_count%s%s%s %ju\n",
+		name, open, label, close, (uintmax_t)hist->count
+	);
+}
+
+// Stats are written in the Prometheus text format in one send, and gauges are
+// only computed here.
+static void statsDump(int fd) {
+	char *buf;
+	size_t len;
+	FILE *file = open_memstream(&buf, &len);
+	if (!file) err(EX_OSERR, "open_memstream");
+
+	fprintf(file, "# TYPE torus_dispatch_nanoseconds histogram\n");
+	for (size_t i = 0; i < ARRAY_LEN(stats.dispatch); ++i) {
+		char label[32];
+		snprintf(label, sizeof(label), "type=\"%s\"", MessageNames[i]);
+		histPrint(
+			file, "torus_dispatch_nanoseconds", label, &stats.dispatch[i]
+		);
+	}
+	fprintf(file, "# TYPE torus_cast_clients histogram\n");
+	histPrint(file, "torus_cast_clients", "", &stats.cast);
+
+	fprintf(file, "# TYPE torus_sent_bytes_total counter\n");
+	fprintf(file, "torus_sent_bytes_total %ju\n", (uintmax_t)stats.sentBytes);
+	fprintf(file, "# TYPE torus_sent_tiles_total counter\n");
+	fprintf(file, "torus_sent_tiles_total %ju\n", (uintmax_t)stats.sentTiles);
+	fprintf(file, "# TYPE torus_send_failures_total counter\n");
+	fprintf(
+		file, "torus_send_failures_total %ju\n",
+		(uintmax_t)stats.sendFailures
+	);
+	fprintf(file, "# TYPE torus_disconnects_total counter\n");
+	for (size_t i = 0; i < DisconnectsLen; ++i) {
+		fprintf(
+			file, "torus_disconnects_total{reason=\"%s\"} %ju\n",
+			DisconnectNames[i], (uintmax_t)stats.disconnects[i]
+		);
+	}
+	fprintf(file, "# TYPE torus_changes_total counter\n");
+	fprintf(file, "torus_changes_total %ju\n", (uintmax_t)(changeSeq - 1));
+
+	size_t subscribers = 0;
+	for (struct Subscriber *sub = subscriberHead; sub; sub = sub->next) {
+		subscribers++;
+	}
+	fprintf(file, "# TYPE torus_subscribers gauge\n");
+	fprintf(file, "torus_subscribers %zu\n", subscribers);
+	fprintf(file, "# TYPE torus_clients gauge\n");
+	fprintf(file, "torus_clients %zu\n", clientsLen);
+
+	uint32_t *occupied = malloc(sizeof(*occupied) * (clientsLen + 1));
+	if (!occupied) err(EX_OSERR, "malloc");
+	for (size_t i = 0; i < clientsLen; ++i) {
+		occupied[i] = clients[i].tileY * TileRows + clients[i].tileX;
+	}
+	qsort(occupied, clientsLen, sizeof(*occupied), tileCompare);
+	size_t tiles = 0, run = 0, most = 0;
+	for (size_t i = 0; i < clientsLen; ++i) {
+		if (!i || occupied[i] != occupied[i - 1]) {
+			tiles++;
+			run = 0;
+		}
+		if (++run > most) most = run;
+	}
+	free(occupied);
+	fprintf(file, "# TYPE torus_occupied_tiles gauge\n");
+	fprintf(file, "torus_occupied_tiles %zu\n", tiles);
+	fprintf(file, "# TYPE torus_tile_clients_max gauge\n");
+	fprintf(file, "torus_tile_clients_max %zu\n", most);
+
+#ifdef FIONWRITE
+	uint64_t queued = 0;
+	for (size_t i = 0; i < clientsLen; ++i) {
+		int bytes;
+		int error = ioctl(clients[i].fd, FIONWRITE, &bytes);
+		if (!error) queued += bytes;
+	}
+	fprintf(file, "# TYPE torus_queued_bytes gauge\n");
+	fprintf(file, "torus_queued_bytes %ju\n", (uintmax_t)queued);
+#endif
+
+	int error = fclose(file);
+	if (error) err(EX_OSERR, "open_memstream");
+
+	int size = len;
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	send(fd, buf, len, 0);
+	free(buf);
+}
+
+static int sockConnect(const char *path) {
+	int sock = socket(PF_LOCAL, SOCK_STREAM, 0);
+	if (sock < 0) err(EX_OSERR, "socket");
+
+	struct sockaddr_un addr = { .sun_family = AF_LOCAL };
+	strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+	int error = connect(sock, (struct sockaddr *)&addr, SUN_LEN(&addr));
+	if (error) err(EX_NOINPUT, "%s", path);
+
+	return sock;
+}
+
+static int sockBind(const char *path) {
+	int sock = socket(PF_LOCAL, SOCK_STREAM, 0);
+	if (sock < 0) err(EX_OSERR, "socket");
+
+	int error = unlink(path);
+	if (error && errno != ENOENT) err(EX_IOERR, "%s", path);
+
+	struct sockaddr_un addr = { .sun_family = AF_LOCAL };
+	strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+	error = bind(sock, (struct sockaddr *)&addr, SUN_LEN(&addr));
+	if (error) err(EX_CANTCREAT, "%s", path);
+
+	return sock;
+}
+
+// Handoffs begin with a magic number ending in a version, which must change
+// whenever struct Handoff or the order of records does.
+static const uint32_t HandoffMagic = 0x746F7203;
+
+// State accompanying each descriptor passed to an upgraded server.
+struct Handoff {
+	enum {
+		HandoffServer,
+		HandoffFeed,
+		HandoffClient,
+		HandoffSubscriber,
+		HandoffHandoff,
+		HandoffStats,
+		HandoffMeta,
+		HandoffFollow,
+	} type;
+	union {
+		struct {
+			uint32_t tileX;
+			uint32_t tileY;
+			uint8_t cellX;
+			uint8_t cellY;
+		} client;
+		struct {
+			uint8_t len;
+			uint8_t buf[sizeof(struct Change)];
+		} follow;
+		uint64_t seq;
+	};
+};
+
+static bool handoffSend(int sock, int fd, struct Handoff state) {
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct iovec iov = { .iov_base = &state, .iov_len = sizeof(state) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+
+	ssize_t size = sendmsg(sock, &msg, 0);
+	return size == sizeof(state);
+}
+
+static int handoffRecv(int sock, struct Handoff *state) {
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct iovec iov = { .iov_base = state, .iov_len = sizeof(*state) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+
+	ssize_t size = recvmsg(sock, &msg, MSG_WAITALL);
+	if (size < 0) err(EX_IOERR, "recvmsg");
+	if (!size) return -1;
+	if ((size_t)size < sizeof(*state)) errx(EX_PROTOCOL, "truncated handoff");
+	if (msg.msg_flags & MSG_CTRUNC) errx(EX_PROTOCOL, "truncated control");
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+		errx(EX_PROTOCOL, "missing descriptor");
+	}
+	int fd;
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+	return fd;
+}
+
+static bool serverHandoff(
+	int sock, int server, int feed, int follow, int handoff, int statsSock
+) {
+	ssize_t size = send(sock, &HandoffMagic, sizeof(HandoffMagic), 0);
+	if (size != sizeof(HandoffMagic)) return false;
+
+	struct Handoff state = { .type = HandoffServer };
+	if (!handoffSend(sock, server, state)) return false;
+
+	state = (struct Handoff) { .type = HandoffMeta };
+	if (!handoffSend(sock, metaFd, state)) return false;
+
+	if (feed >= 0) {
+		state = (struct Handoff) { .type = HandoffFeed, .seq = changeSeq };
+		if (!handoffSend(sock, feed, state)) return false;
+	}
+
+	// The followed feed is passed on with any partial change read from it, so
+	// that no change is missed or applied twice.
+	if (follow >= 0) {
+		state = (struct Handoff) {
+			.type = HandoffFollow,
+			.follow = { .len = followLen },
+		};
+		memcpy(state.follow.buf, followBuf, followLen);
+		if (!handoffSend(sock, follow, state)) return false;
+	}
+
+	// Listeners are passed on rather than bound again, so that their paths
+	// still reach this server if the upgraded one fails to start.
+	state = (struct Handoff) { .type = HandoffHandoff };
+	if (!handoffSend(sock, handoff, state)) return false;
+	if (statsSock >= 0) {
+		state = (struct Handoff) { .type = HandoffStats };
+		if (!handoffSend(sock, statsSock, state)) return false;
+	}
+
+	for (size_t i = 0; i < clientsLen; ++i) {
+		const struct Client *client = &clients[i];
+		state = (struct Handoff) {
+			.type = HandoffClient,
+			.client = {
+				.tileX = client->tileX,
+				.tileY = client->tileY,
+				.cellX = client->cellX,
+				.cellY = client->cellY,
+			},
+		};
+		if (!handoffSend(sock, client->fd, state)) return false;
+	}
+
+	// Changes are not handed off, so only subscribers which have caught up
+	// can be resumed.
+	for (struct Subscriber *sub = subscriberHead; sub; sub = sub->next) {
+		if (!sub->ready || sub->seq != changeSeq || sub->off) continue;
+		state = (struct Handoff) { .type = HandoffSubscriber, .seq = sub->seq };
+		if (!handoffSend(sock, sub->fd, state)) return false;
+	}
+
+	return true;
+}
+
+static int serverTakeover(
+	int sock, const char *path,
+	int *feed, int *follow, int *handoff, int *statsSock
+) {
+	uint32_t magic;
+	ssize_t size = recv(sock, &magic, sizeof(magic), MSG_WAITALL);
+	if (size < 0) err(EX_IOERR, "%s", path);
+	if (size != sizeof(magic) || magic != HandoffMagic) {
+		errx(EX_PROTOCOL, "%s: incompatible handoff", path);
+	}
+
+	struct Handoff state;
+	int server = handoffRecv(sock, &state);
+	if (server < 0 || state.type != HandoffServer) {
+		errx(EX_PROTOCOL, "%s: no listening socket", path);
+	}
+
+	int fd;
+	while (0 <= (fd = handoffRecv(sock, &state))) {
+		switch (state.type) {
+			break; case HandoffFeed: {
+				*feed = fd;
+				changeTail = state.seq;
+				changeSeq = state.seq;
+			}
+			break; case HandoffClient: {
+				if (
+					state.client.tileX >= TileCols ||
+					state.client.tileY >= TileRows
+				) {
+					errx(EX_PROTOCOL, "invalid handoff tile");
+				}
+				if (
+					state.client.cellX >= CellCols ||
+					state.client.cellY >= CellRows
+				) {
+					errx(EX_PROTOCOL, "invalid handoff cell");
+				}
+				struct Client *client = clientAdd(fd);
+				if (!client) {
+					close(fd);
+					break;
+				}
+				client->tileX = state.client.tileX;
+				client->tileY = state.client.tileY;
+				client->cellX = state.client.cellX;
+				client->cellY = state.client.cellY;
+			}
+			break; case HandoffSubscriber: {
+				struct Subscriber *sub = subscriberAdd(fd);
+				sub->ready = true;
+				sub->seq = state.seq;
+			}
+			break; case HandoffHandoff: *handoff = fd;
+			break; case HandoffStats:   *statsSock = fd;
+			break; case HandoffMeta:    metaMap(fd);
+			break; case HandoffFollow: {
+				if (!replica) errx(EX_USAGE, "%s: replica requires -o", path);
+				if (state.follow.len >= sizeof(state.follow.buf)) {
+					errx(EX_PROTOCOL, "invalid handoff follow");
+				}
+				*follow = fd;
+				followLen = state.follow.len;
+				memcpy(followBuf, state.follow.buf, followLen);
+			}
+			break; default: errx(EX_PROTOCOL, "invalid handoff type");
+		}
+	}
+	return server;
+}
+
+// The previous server waits for a byte once this one is ready to serve, and
+// resumes if this one exits first. It releases its pidfile as it exits.
+static void serverReady(int sock) {
+	int on = 1;
+	int error = setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+	if (error) err(EX_IOERR, "setsockopt");
+
+	char ready = 1;
+	ssize_t size = send(sock, &ready, sizeof(ready), 0);
+	if (size < 0) err(EX_UNAVAILABLE, "handoff");
+
+	size = recv(sock, &ready, sizeof(ready), 0);
+	if (size < 0) err(EX_IOERR, "handoff");
+	close(sock);
+}
+
+#ifdef __FreeBSD__
+// Rights can only be narrowed, and descriptors handed off by an older server
+// may lack some of those wanted, so they keep only those they have.
+static cap_rights_t rightsLimit(int fd, cap_rights_t rights) {
+	cap_rights_t have;
+	int error = cap_rights_get(fd, &have);
+	if (error) err(EX_OSERR, "cap_rights_get");
+	cap_rights_t lack = rights;
+	cap_rights_remove(&lack, &have);
+	cap_rights_remove(&rights, &lack);
+	error = cap_rights_limit(fd, &rights);
+	if (error) err(EX_OSERR, "cap_rights_limit");
+	return rights;
+}
+
+static void clientRightsLimit(int fd, cap_rights_t rights) {
+	rights = rightsLimit(fd, rights);
+	if (!cap_rights_is_set(&rights, CAP_IOCTL)) return;
+	unsigned long cmds[] = { FIONWRITE };
+	int error = cap_ioctls_limit(fd, cmds, ARRAY_LEN(cmds));
+	if (error) err(EX_OSERR, "cap_ioctls_limit");
+}
+#endif
+
 int main(int argc, char *argv[]) {
 	int error;
 
+	bool upgrade = false;
 	const char *dataPath = DefaultDataPath;
+	const char *feedPath = NULL;
+	const char *followPath = NULL;
+	const char *handoffPath = NULL;
 	const char *sockPath = DefaultSockPath;
 	const char *pidPath = NULL;
+	const char *statsPath = NULL;
+	const char *tracePath = NULL;
+	size_t max = getdtablesize();
 	int opt;
-	while (0 < (opt = getopt(argc, argv, "d:p:s:"))) {
+	while (0 < (opt = getopt(argc, argv, "c:d:f:m:o:p:r:s:t:uw:"))) {
 		switch (opt) {
+			break; case 'c': statsPath = optarg;
 			break; case 'd': dataPath = optarg;
+			break; case 'f': feedPath = optarg;
+			break; case 'm': {
+				char *end;
+				max = strtoul(optarg, &end, 0);
+				if (!max || *end) {
+					errx(EX_USAGE, "max must be a positive number");
+				}
+			}
+			break; case 'o': followPath = optarg; replica = true;
 			break; case 'p': pidPath = optarg;
+			break; case 'r': handoffPath = optarg;
 			break; case 's': sockPath = optarg;
+			break; case 't': idleTimeout = strtoul(optarg, NULL, 0);
+			break; case 'u': upgrade = true;
+			break; case 'w': tracePath = optarg;
 			break; default:  return EX_USAGE;
 		}
 	}
+	if (upgrade && !handoffPath) return EX_USAGE;
+	// Clients beyond the descriptor table could never connect.
+	if (max > (size_t)getdtablesize()) max = getdtablesize();
+
+	tilesMap(dataPath);
+	wheelInit();
+	clientsAlloc(max);
+	if (tracePath) traceOpen(tracePath);
+
+	// The running server hands off its sockets, then waits for this one to
+	// be ready before it exits.
+	int server;
+	int feed = -1;
+	int follow = -1;
+	int handoff = -1;
+	int statsSock = -1;
+	int previous = -1;
+	if (upgrade) {
+		previous = sockConnect(handoffPath);
+		server = serverTakeover(
+			previous, handoffPath, &feed, &follow, &handoff, &statsSock
+		);
+	} else {
+		server = sockBind(sockPath);
+	}
+	if (follow < 0 && followPath) {
+		follow = sockConnect(followPath);
+		uint64_t seq = 0;
+		ssize_t size = send(follow, &seq, sizeof(seq), 0);
+		if (size < 0) err(EX_IOERR, "%s", followPath);
+	}
+	if (metaFd < 0 && (!metaBuild(follow) || !followRelease())) {
+		errx(EX_UNAVAILABLE, "%s: feed closed", followPath);
+	}
+	if (feed < 0 && feedPath) feed = sockBind(feedPath);
+	if (handoff < 0 && handoffPath) handoff = sockBind(handoffPath);
+	if (statsSock < 0 && statsPath) statsSock = sockBind(statsPath);
 
 #ifdef __FreeBSD__
-	struct pidfh *pid = NULL;
-	if (pidPath) {
-		pid = pidfile_open(pidPath, 0600, NULL);
-		if (!pid) err(EX_CANTCREAT, "%s", pidPath);
+	cap_rights_t rights;
+	cap_rights_init(
+		&rights,
+		CAP_LISTEN, CAP_ACCEPT, CAP_EVENT,
+		CAP_READ, CAP_WRITE, CAP_SETSOCKOPT
+	);
+	if (statsSock >= 0) rightsLimit(statsSock, rights);
+	cap_rights_t metaRights;
+	cap_rights_init(&metaRights, CAP_MMAP_RW, CAP_FSTAT);
+	rightsLimit(metaFd, metaRights);
+	if (trace) {
+		cap_rights_t traceRights;
+		cap_rights_init(&traceRights, CAP_WRITE, CAP_FSTAT);
+		error = cap_rights_limit(fileno(trace), &traceRights);
+		if (error) err(EX_OSERR, "cap_rights_limit");
 	}
-#endif
 
-	tilesMap(dataPath);
+	// Clients inherit the rights of the listening socket, and the stats
+	// socket reads their queued output.
+	cap_rights_set(&rights, CAP_IOCTL);
+	clientRightsLimit(server, rights);
+	for (size_t i = 0; i < clientsLen; ++i) {
+		clientRightsLimit(clients[i].fd, rights);
+	}
+	cap_rights_clear(&rights, CAP_IOCTL);
+
+	if (feed >= 0) rightsLimit(feed, rights);
+	if (follow >= 0) rightsLimit(follow, rights);
+	if (handoff >= 0) {
+		// Connections for the handoff are shut down once it is sent.
+		cap_rights_set(&rights, CAP_SHUTDOWN);
+		rightsLimit(handoff, rights);
+	}
+#endif
 
-	int server = socket(PF_LOCAL, SOCK_STREAM, 0);
-	if (server < 0) err(EX_OSERR, "socket");
+	error = listen(server, 0);
+	if (error) err(EX_OSERR, "listen");
 
-	error = unlink(sockPath);
-	if (error && errno != ENOENT) err(EX_IOERR, "%s", sockPath);
+	if (feed >= 0) {
+		error = listen(feed, 0);
+		if (error) err(EX_OSERR, "listen");
+	}
+	if (handoff >= 0) {
+		error = listen(handoff, 0);
+		if (error) err(EX_OSERR, "listen");
+	}
+	if (statsSock >= 0) {
+		error = listen(statsSock, 0);
+		if (error) err(EX_OSERR, "listen");
+	}
 
-	struct sockaddr_un addr = { .sun_family = AF_LOCAL };
-	strlcpy(addr.sun_path, sockPath, sizeof(addr.sun_path));
-	error = bind(server, (struct sockaddr *)&addr, SUN_LEN(&addr));
-	if (error) err(EX_CANTCREAT, "%s", sockPath);
+	if (previous >= 0) serverReady(previous);
 
 #ifdef __FreeBSD__
+	struct pidfh *pid = NULL;
+	if (pidPath) {
+		pid = pidfile_open(pidPath, 0600, NULL);
+		if (!pid) err(EX_CANTCREAT, "%s", pidPath);
+	}
+
 	error = cap_enter();
 	if (error) err(EX_OSERR, "cap_enter");
 
-	cap_rights_t rights;
-	cap_rights_init(
-		&rights,
-		CAP_LISTEN, CAP_ACCEPT, CAP_EVENT,
-		CAP_READ, CAP_WRITE, CAP_SETSOCKOPT
-	);
-	error = cap_rights_limit(server, &rights);
-	if (error) err(EX_OSERR, "cap_rights_limit");
-
 	if (pid) {
 		cap_rights_init(&rights, CAP_PWRITE, CAP_FSTAT, CAP_FTRUNCATE);
 		error = cap_rights_limit(pidfile_fileno(pid), &rights);
@@ -431,9 +1618,6 @@ int main(int argc, char *argv[]) {
 	}
 #endif
 
-	error = listen(server, 0);
-	if (error) err(EX_OSERR, "listen");
-
 	int kq = kqueue();
 	if (kq < 0) err(EX_OSERR, "kqueue");
 
@@ -442,15 +1626,148 @@ int main(int argc, char *argv[]) {
 	int nevents = kevent(kq, &event, 1, NULL, 0, NULL);
 	if (nevents < 0) err(EX_OSERR, "kevent");
 
+	if (feed >= 0) {
+		EV_SET(&event, feed, EVFILT_READ, EV_ADD, 0, 0, 0);
+		nevents = kevent(kq, &event, 1, NULL, 0, NULL);
+		if (nevents < 0) err(EX_OSERR, "kevent");
+	}
+	if (follow >= 0) {
+		EV_SET(&event, follow, EVFILT_READ, EV_ADD, 0, 0, 0);
+		nevents = kevent(kq, &event, 1, NULL, 0, NULL);
+		if (nevents < 0) err(EX_OSERR, "kevent");
+	}
+	if (handoff >= 0) {
+		EV_SET(&event, handoff, EVFILT_READ, EV_ADD, 0, 0, 0);
+		nevents = kevent(kq, &event, 1, NULL, 0, NULL);
+		if (nevents < 0) err(EX_OSERR, "kevent");
+	}
+	if (statsSock >= 0) {
+		EV_SET(&event, statsSock, EVFILT_READ, EV_ADD, 0, 0, 0);
+		nevents = kevent(kq, &event, 1, NULL, 0, NULL);
+		if (nevents < 0) err(EX_OSERR, "kevent");
+	}
+
+	for (size_t i = 0; i < clientsLen; ++i) {
+		EV_SET(
+			&event, clients[i].fd, EVFILT_READ, EV_ADD, 0, 0,
+			(uintptr_t)clientSerials[clients[i].fd]
+		);
+		nevents = kevent(kq, &event, 1, NULL, 0, NULL);
+		if (nevents < 0) err(EX_OSERR, "kevent");
+	}
+	for (struct Subscriber *sub = subscriberHead; sub; sub = sub->next) {
+		struct kevent events[2];
+		EV_SET(&events[0], sub->fd, EVFILT_READ, EV_ADD, 0, 0, 0);
+		EV_SET(&events[1], sub->fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, 0);
+		nevents = kevent(kq, events, 2, NULL, 0, NULL);
+		if (nevents < 0) err(EX_OSERR, "kevent");
+	}
+
+	int ready = 0;
+	int next = 0;
+	struct kevent events[64];
 	for (;;) {
-		nevents = kevent(kq, NULL, 0, &event, 1, NULL);
-		if (nevents < 0) err(EX_IOERR, "kevent");
+		clientsReap();
+		if (next == ready) {
+			wheelAdvance(wheelNow());
+			if (trace && fflush(trace)) traceFail();
+
+			// Wake at least once a tick while timers may be armed.
+			struct timespec tick = { .tv_sec = 1 };
+			ready = kevent(
+				kq, NULL, 0, events, ARRAY_LEN(events),
+				(idleTimeout ? &tick : NULL)
+			);
+			if (ready < 0) err(EX_IOERR, "kevent");
+			next = 0;
+			if (!ready) continue;
+		}
+		event = events[next++];
+
+		if (handoff >= 0 && event.ident == (uintptr_t)handoff) {
+			int sock = accept(handoff, NULL, NULL);
+			if (sock < 0) err(EX_IOERR, "accept");
+
+			if (
+				!serverHandoff(sock, server, feed, follow, handoff, statsSock)
+			) {
+				warn("handoff");
+				close(sock);
+				continue;
+			}
+
+			// The upgraded server sends a byte once it is ready, or closes
+			// the connection if it fails to start.
+			char ready;
+			ssize_t size = 0;
+			error = shutdown(sock, SHUT_WR);
+			if (!error) size = recv(sock, &ready, sizeof(ready), 0);
+			if (size != sizeof(ready)) {
+				warnx("handoff: upgraded server failed to start");
+				close(sock);
+				continue;
+			}
+
+#ifdef __FreeBSD__
+			if (pid) pidfile_close(pid);
+#endif
+			close(sock);
+			return EX_OK;
+		}
+
+		if (statsSock >= 0 && event.ident == (uintptr_t)statsSock) {
+			int fd = accept(statsSock, NULL, NULL);
+			if (fd < 0) err(EX_IOERR, "accept");
+			fcntl(fd, F_SETFL, O_NONBLOCK);
+
+			int on = 1;
+			error = setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+			if (error) err(EX_IOERR, "setsockopt");
+
+			statsDump(fd);
+			close(fd);
+			continue;
+		}
+
+		if (follow >= 0 && event.ident == (uintptr_t)follow) {
+			if (!feedFollow(follow)) {
+				errx(EX_UNAVAILABLE, "%s: feed closed", followPath);
+			}
+			continue;
+		}
+
+		if (feed >= 0 && event.ident == (uintptr_t)feed) {
+			int fd = accept(feed, NULL, NULL);
+			if (fd < 0) err(EX_IOERR, "accept");
+			fcntl(fd, F_SETFL, O_NONBLOCK);
+
+			int on = 1;
+			error = setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+			if (error) err(EX_IOERR, "setsockopt");
+
+			subscriberAdd(fd);
 
-		if (!event.udata) {
+			struct kevent events[2];
+			EV_SET(&events[0], fd, EVFILT_READ, EV_ADD, 0, 0, 0);
+			EV_SET(&events[1], fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, 0);
+			nevents = kevent(kq, events, 2, NULL, 0, NULL);
+			if (nevents < 0) err(EX_IOERR, "kevent");
+
+			continue;
+		}
+
+		if (event.ident == (uintptr_t)server) {
 			int fd = accept(server, NULL, NULL);
 			if (fd < 0) err(EX_IOERR, "accept");
 			fcntl(fd, F_SETFL, O_NONBLOCK);
 
+			struct Client *client = clientAdd(fd);
+			if (!client) {
+				stats.disconnects[DisconnectFull]++;
+				close(fd);
+				continue;
+			}
+
 			int on = 1;
 			error = setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
 			if (error) err(EX_IOERR, "setsockopt");
@@ -459,9 +1776,10 @@ int main(int argc, char *argv[]) {
 			error = setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
 			if (error) err(EX_IOERR, "setsockopt");
 
-			struct Client *client = clientAdd(fd);
-
-			EV_SET(&event, fd, EVFILT_READ, EV_ADD, 0, 0, client);
+			EV_SET(
+				&event, fd, EVFILT_READ, EV_ADD, 0, 0,
+				(uintptr_t)clientSerials[fd]
+			);
 			nevents = kevent(kq, &event, 1, NULL, 0, NULL);
 			if (nevents < 0) err(EX_IOERR, "kevent");
 
@@ -469,42 +1787,67 @@ int main(int argc, char *argv[]) {
 			bool success = clientSend(client, msg)
 				&& clientMove(client, 0, 0)
 				&& clientCursors(client);
-			if (!success) clientRemove(client);
+			if (!success) clientRemove(client, DisconnectSend);
 
 			continue;
 		}
 
-		struct Client *client = (struct Client *)event.udata;
+		struct Client *client = clientFind(event.ident);
+		if (!client) {
+			struct Subscriber *sub = subscriberFind(event.ident);
+			if (!sub) continue;
+
+			// Subscribers write only the sequence number to resume from, or
+			// zero to receive new changes.
+			if (event.filter == EVFILT_READ) {
+				if (sub->ready || event.flags & EV_EOF) {
+					subscriberRemove(sub);
+					continue;
+				}
+				uint64_t seq;
+				ssize_t size = recv(sub->fd, &seq, sizeof(seq), 0);
+				if (size < 0 && errno == EAGAIN) continue;
+				if (size != sizeof(seq)) {
+					subscriberRemove(sub);
+					continue;
+				}
+				sub->ready = true;
+				sub->seq = (seq ? seq : changeSeq);
+			}
+
+			if (!subscriberFlush(sub)) subscriberRemove(sub);
+			continue;
+		}
+
+		// An event from an earlier batch may belong to a connection which has
+		// since been closed and its descriptor reused.
+		if ((uintptr_t)event.udata != clientSerials[client->fd]) continue;
+		if (client->drop) continue;
+
 		if (event.flags & EV_EOF) {
-			clientRemove(client);
+			clientRemove(client, DisconnectClosed);
 			continue;
 		}
 
-		struct ClientMessage msg;
-		ssize_t size = recv(client->fd, &msg, sizeof(msg), 0);
-		if (size != sizeof(msg)) {
-			clientRemove(client);
+		// Read whatever burst of messages is queued in one call.
+		struct ClientMessage msgs[16];
+		ssize_t size = recv(client->fd, msgs, sizeof(msgs), 0);
+		TRACE(RECEIVE, client->fd, size, client->tileX, client->tileY);
+		if (size < 0 && errno == EAGAIN) continue;
+		if (size <= 0) {
+			clientRemove(client, (size ? DisconnectRead : DisconnectClosed));
+			continue;
+		}
+		if (size % sizeof(msgs[0])) {
+			clientRemove(client, DisconnectPartial);
 			continue;
 		}
+		clientIdle[client->fd].active = wheelTick;
 
-		bool success = false;
-		switch (msg.type) {
-			break; case ClientMove: {
-				success = clientMove(client, msg.move.dx, msg.move.dy);
-			}
-			break; case ClientFlip: {
-				success = clientFlip(client);
-			}
-			break; case ClientPut: {
-				success = clientPut(client, msg.put.color, msg.put.cell);
-			}
-			break; case ClientMap: {
-				success = clientMap(client);
-			}
-			break; case ClientTele: {
-				success = clientTele(client, msg.port);
-			}
+		bool success = true;
+		for (size_t j = 0; success && j < size / sizeof(msgs[0]); ++j) {
+			success = clientDispatch(client, msgs[j]);
 		}
-		if (!success) clientRemove(client);
+		if (!success) clientRemove(client, DisconnectDispatch);
 	}
 }
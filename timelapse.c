@@ -0,0 +1,242 @@
+/* Copyright (C) 2019  C. McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "png.h"
+#include "torus.h"
+#include "render.h"
+
+static uint32_t tileX = TileInitX;
+static uint32_t tileY = TileInitY;
+static uint32_t cols = 1;
+static uint32_t rows = 1;
+
+// Only the pages of the region are kept, read in file order from each
+// snapshot and stored by their position in the region.
+static struct Tile *tiles;
+static struct Slot {
+	off_t offset;
+	uint32_t index;
+} *slots;
+
+static int slotCompare(const void *_a, const void *_b) {
+	const struct Slot *a = _a, *b = _b;
+	return (a->offset > b->offset) - (a->offset < b->offset);
+}
+
+static void slotsInit(void) {
+	tiles = aligned_alloc(alignof(struct Tile), sizeof(*tiles) * cols * rows);
+	slots = calloc(cols * rows, sizeof(*slots));
+	if (!tiles || !slots) err(EX_OSERR, "malloc");
+	for (uint32_t r = 0; r < rows; ++r) {
+		for (uint32_t c = 0; c < cols; ++c) {
+			uint32_t y = (tileY + r) % TileRows;
+			uint32_t x = (tileX + c) % TileCols;
+			slots[r * cols + c] = (struct Slot) {
+				.offset = (off_t)sizeof(struct Tile) * (y * TileCols + x),
+				.index = r * cols + c,
+			};
+		}
+	}
+	qsort(slots, cols * rows, sizeof(*slots), slotCompare);
+}
+
+// Decompression stops after the last page of the region.
+static void snapshotRead(const char *path) {
+	gzFile file = gzopen(path, "r");
+	if (!file) err(EX_NOINPUT, "%s", path);
+	gzbuffer(file, 128 * 1024);
+
+	for (uint32_t i = 0; i < cols * rows; ++i) {
+		if (gzseek(file, slots[i].offset, SEEK_SET) < 0) {
+			errx(EX_DATAERR, "%s: truncated tiles", path);
+		}
+		struct Tile *tile = &tiles[slots[i].index];
+		int len = gzread(file, tile, sizeof(*tile));
+		if (len < 0) {
+			int error;
+			errx(EX_DATAERR, "%s: %s", path, gzerror(file, &error));
+		}
+		if ((size_t)len < sizeof(*tile)) {
+			errx(EX_DATAERR, "%s: truncated tiles", path);
+		}
+	}
+	gzclose(file);
+}
+
+// Frames are drawn with a 17th, transparent color where a pixel is unchanged
+// from the previous frame, and cover only the rectangle of changed pixels.
+enum { Transparent = 16 };
+
+static uint32_t width;
+static uint32_t height;
+static uint8_t *frame;
+static uint8_t *prev;
+
+static void frameRaster(void) {
+	uint32_t tileWidth = renderWidth();
+	for (uint32_t r = 0; r < rows; ++r) {
+		for (uint32_t cellY = 0; cellY < CellRows; ++cellY) {
+			for (uint32_t y = 0; y < font.glyph.height; ++y) {
+				uint32_t py = (r * CellRows + cellY) * font.glyph.height + y;
+				for (uint32_t c = 0; c < cols; ++c) {
+					renderRow(
+						&frame[py * width + c * tileWidth],
+						&tiles[r * cols + c], cellY, y
+					);
+				}
+			}
+		}
+	}
+}
+
+static uint32_t seq;
+static uint16_t delay = 100;
+
+static void frameWrite(FILE *stream, bool first) {
+	uint32_t left = width, right = 0, top = height, bottom = 0;
+	for (uint32_t y = 0; y < height; ++y) {
+		const uint8_t *a = &frame[y * width];
+		const uint8_t *b = &prev[y * width];
+		if (!first && !memcmp(a, b, width)) continue;
+		if (y < top) top = y;
+		bottom = y + 1;
+		uint32_t x0 = 0, x1 = width;
+		if (!first) {
+			while (a[x0] == b[x0]) x0++;
+			while (a[x1 - 1] == b[x1 - 1]) x1--;
+		}
+		if (x0 < left) left = x0;
+		if (x1 > right) right = x1;
+	}
+	// An unchanged frame is a single transparent pixel.
+	if (top == height) {
+		left = top = 0;
+		right = bottom = 1;
+	}
+
+	uint32_t frameWidth = right - left;
+	uint32_t frameHeight = bottom - top;
+	uint32_t len = renderRowLen(frameWidth);
+	uint8_t *data = malloc((size_t)frameHeight * len);
+	uint8_t *above = calloc(len, 1);
+	uint8_t *row = malloc(len);
+	uint8_t *scratch = malloc(len);
+	if (!data || !above || !row || !scratch) err(EX_OSERR, "malloc");
+
+	for (uint32_t y = 0; y < frameHeight; ++y) {
+		const uint8_t *a = &frame[(top + y) * width + left];
+		const uint8_t *b = &prev[(top + y) * width + left];
+		row[0] = PNGNone;
+		for (uint32_t x = 0; x < frameWidth; ++x) {
+			row[1 + x] = (!first && a[x] == b[x] ? Transparent : a[x]);
+		}
+		renderFilter(&data[y * len], row, above, len, scratch);
+		uint8_t *swap = above;
+		above = row;
+		row = swap;
+	}
+
+	size_t zlen = compressBound((size_t)frameHeight * len);
+	uint8_t *zdata = malloc(zlen);
+	if (!zdata) err(EX_OSERR, "malloc");
+	zlen = renderDeflate(zdata, zlen, data, (size_t)frameHeight * len);
+
+	pngFrame(
+		stream, seq++, frameWidth, frameHeight, left, top, delay, 1000,
+		PNGDisposeNone, (first ? PNGBlendSource : PNGBlendOver)
+	);
+	if (first) {
+		pngDeflated(stream, zdata, zlen);
+	} else {
+		pngFrameDeflated(stream, seq++, zdata, zlen);
+	}
+
+	free(data);
+	free(above);
+	free(row);
+	free(scratch);
+	free(zdata);
+
+	uint8_t *swap = prev;
+	prev = frame;
+	frame = swap;
+}
+
+int main(int argc, char *argv[]) {
+	const char *fontPath = DefaultFontPath;
+
+	int opt;
+	while (0 < (opt = getopt(argc, argv, "f:h:l:p:t:w:x:y:"))) {
+		switch (opt) {
+			break; case 'f': fontPath = optarg;
+			break; case 'h': rows = strtoul(optarg, NULL, 0);
+			break; case 'l': renderOptions.level = strtol(optarg, NULL, 0);
+			break; case 'p': renderFilterName(optarg);
+			break; case 't': delay = strtoul(optarg, NULL, 0);
+			break; case 'w': cols = strtoul(optarg, NULL, 0);
+			break; case 'x': tileX = strtoul(optarg, NULL, 0) % TileCols;
+			break; case 'y': tileY = strtoul(optarg, NULL, 0) % TileRows;
+			break; default:  return EX_USAGE;
+		}
+	}
+	if (optind == argc) errx(EX_USAGE, "no snapshots");
+	if (!cols || cols > TileCols || !rows || rows > TileRows) {
+		errx(EX_USAGE, "region must be 1 to %d tiles", TileCols);
+	}
+	if (renderOptions.level < -1 || renderOptions.level > 9) {
+		errx(EX_USAGE, "level must be -1 to 9");
+	}
+
+	// The transparent color needs a fifth bit.
+	renderOptions.depth = 8;
+	fontLoad(fontPath);
+	slotsInit();
+
+	width = cols * renderWidth();
+	height = rows * renderHeight();
+	frame = malloc((size_t)width * height);
+	prev = malloc((size_t)width * height);
+	if (!frame || !prev) err(EX_OSERR, "malloc");
+
+	uint8_t palette[Transparent + 1][3] = {{0}};
+	memcpy(palette, Palette, sizeof(Palette));
+	uint8_t alpha[Transparent + 1];
+	memset(alpha, 0xFF, Transparent);
+	alpha[Transparent] = 0;
+
+	pngHead(stdout, width, height, 8, PNGIndexed);
+	pngAnimation(stdout, argc - optind, 0);
+	pngPalette(stdout, (uint8_t *)palette, sizeof(palette));
+	pngTransparency(stdout, alpha, sizeof(alpha));
+	for (int i = optind; i < argc; ++i) {
+		snapshotRead(argv[i]);
+		frameRaster();
+		frameWrite(stdout, i == optind);
+	}
+	pngTail(stdout);
+
+	int error = fflush(stdout);
+	if (error) err(EX_IOERR, "stdout");
+}
@@ -124,6 +124,9 @@ enum {
 	MapCols = 11,
 };
 
+// Each cell of a map at zoom z summarizes 2^z by 2^z tiles.
+enum { MapZoomMax = 6 };
+
 struct Map {
 	time_t now;
 	struct Meta min;
@@ -131,6 +134,105 @@ struct Map {
 	struct Meta meta[MapRows][MapCols];
 };
 
+static inline void mapInit(struct Map *map, time_t now) {
+	*map = (struct Map) {
+		.now = now,
+		.min = {
+			.createTime = now,
+			.modifyTime = now,
+			.accessTime = now,
+			.modifyCount = UINT32_MAX,
+			.accessCount = UINT32_MAX,
+		},
+	};
+}
+
+static inline void mapSet(struct Map *map, int y, int x, struct Meta meta) {
+	if (meta.createTime > 1) {
+		if (meta.createTime < map->min.createTime) {
+			map->min.createTime = meta.createTime;
+		}
+		if (meta.createTime > map->max.createTime) {
+			map->max.createTime = meta.createTime;
+		}
+	}
+	if (meta.modifyTime) {
+		if (meta.modifyTime < map->min.modifyTime) {
+			map->min.modifyTime = meta.modifyTime;
+		}
+		if (meta.modifyTime > map->max.modifyTime) {
+			map->max.modifyTime = meta.modifyTime;
+		}
+	}
+	if (meta.accessTime) {
+		if (meta.accessTime < map->min.accessTime) {
+			map->min.accessTime = meta.accessTime;
+		}
+		if (meta.accessTime > map->max.accessTime) {
+			map->max.accessTime = meta.accessTime;
+		}
+	}
+	if (meta.modifyCount < map->min.modifyCount) {
+		map->min.modifyCount = meta.modifyCount;
+	}
+	if (meta.modifyCount > map->max.modifyCount) {
+		map->max.modifyCount = meta.modifyCount;
+	}
+	if (meta.accessCount < map->min.accessCount) {
+		map->min.accessCount = meta.accessCount;
+	}
+	if (meta.accessCount > map->max.accessCount) {
+		map->max.accessCount = meta.accessCount;
+	}
+	map->meta[y][x] = meta;
+}
+
+// Thumbnails hold the apparent color of each block of cells in a tile.
+enum {
+	ThumbRows = 5,
+	ThumbCols = 8,
+	ThumbBlockRows = CellRows / ThumbRows,
+	ThumbBlockCols = CellCols / ThumbCols,
+};
+
+struct Thumb {
+	uint8_t colors[ThumbRows][ThumbCols];
+};
+
+enum {
+	MinimapRows = 9,
+	MinimapCols = 9,
+};
+
+struct Minimap {
+	struct Thumb thumbs[MinimapRows][MinimapCols];
+};
+
+// Cells appear as their background color if mostly empty and foreground
+// otherwise.
+static inline uint8_t cellColor(uint8_t cell, uint8_t color) {
+	bool empty = (cell == 0x00 || cell == ' ' || cell == 0xB0 || cell == 0xFF);
+	return (empty ? color >> 4 : color) & 0x0F;
+}
+
+// Cells vote for the color they appear as, and the block takes the color
+// with the most votes.
+static inline uint8_t thumbBlock(const struct Tile *tile, int y, int x) {
+	uint8_t votes[16] = {0};
+	int cellY = y * ThumbBlockRows;
+	int cellX = x * ThumbBlockCols;
+	for (int i = cellY; i < cellY + ThumbBlockRows; ++i) {
+		for (int j = cellX; j < cellX + ThumbBlockCols; ++j) {
+			votes[cellColor(tile->cells[i][j], tile->colors[i][j])]++;
+		}
+	}
+	uint8_t color = 0;
+	for (uint8_t i = 1; i < ARRAY_LEN(votes); ++i) {
+		if (votes[i] > votes[color]) color = i;
+	}
+	return color;
+}
+
 struct ServerMessage {
 	enum {
 		ServerTile,
@@ -138,6 +240,7 @@ struct ServerMessage {
 		ServerPut,
 		ServerCursor,
 		ServerMap,
+		ServerThumb,
 	} type;
 	union {
 		struct {
@@ -168,6 +271,7 @@ struct ClientMessage {
 		ClientPut,
 		ClientMap,
 		ClientTele,
+		ClientThumb,
 	} type;
 	union {
 		struct {
@@ -178,6 +282,33 @@ struct ClientMessage {
 			uint8_t color;
 			uint8_t cell;
 		} put;
+		struct {
+			uint8_t zoom;
+			int8_t dx;
+			int8_t dy;
+		} map;
 		uint8_t port;
 	};
 };
+
+struct Change {
+	uint64_t seq;
+	time_t time;
+	uint32_t tileX;
+	uint32_t tileY;
+	uint8_t cellX;
+	uint8_t cellY;
+	uint8_t color;
+	uint8_t cell;
+};
+
+struct Trace {
+	uint64_t time;
+	uint32_t conn;
+	enum {
+		TraceConnect,
+		TraceMessage,
+		TraceDisconnect,
+	} type;
+	struct ClientMessage msg;
+};